@@ -16,7 +16,11 @@
  */
 
 #include "jit.common.h"
+#include "ext_atomic.h"
+#include "jit.half.h"
 #include <math.h>
+#include <stdio.h>
+#include <float.h>
 
 /*
  * Constants
@@ -25,6 +29,117 @@
 #define kMaxNeighborLines 272 //tested from max patch, it doesn't like rendering more lines than this
 #define kMaxNumBoids 1000
 #define MAX_FLOCKS 6 // Maximum number of flocks allowed in simulation
+#define kNumOutlets 12 // matrix outlets of the mop
+
+/*
+ * Frame phases timed when profiling is on, in the order they are output in the 5th outlet
+ */
+#define kProfileAging 0 // aging and deaths
+#define kProfileNeighbors 1 // neighbor search (without neighbor lines)
+#define kProfileSteering 2 // centering, attractors and the weighted velocity
+#define kProfileIntegration 3 // speed limits and position update
+#define kProfileWalls 4 // wall avoidance
+#define kProfileLines 5 // neighbor line generation
+#define kProfilePacking 6 // filling the output matrices
+#define kProfileTotal 7 // the whole matrix_calc
+#define kNumProfilePhases 8
+static const char *kProfilePhaseNames[kNumProfilePhases] = {"aging", "neighbors", "steering", "integration", "walls", "lines", "packing", "total"};
+#define kProfileWindow 128 // number of frames the rolling statistics are computed over
+#define kProfileSampleStride 16 // every 16th boid has its per-boid phases timed, the others only count in the loop total
+#define kMaxTraceEvents 262144 // size of the trace buffer, a few minutes of frames
+
+/*
+ * Neighbor density histograms (6th outlet); bin i counts the boids with a value in [i*width, (i+1)*width),
+ * the last bin also holds everything above it
+ */
+#define kHistogramBins 32
+#define kNeighborBinWidth ((kMaxNeighbors + kHistogramBins) / kHistogramBins) // neighbors found per boid
+#define kCandidateBinWidth ((kMaxNumBoids + kHistogramBins) / kHistogramBins) // candidates tested per boid
+
+/*
+ * Per-flock statistics (8th outlet), one row per flock: centroid x y z, positional variance x y z,
+ * bounding box min x y z and max x y z, mean speed, polarization, angular momentum x y z
+ */
+#define kFlockStatsPlanes 17
+
+/*
+ * Attractor statistics, appended to the 5 planes of the 3rd outlet:
+ * boids inside the radius per flock, their mean distance per flock, nearest boid ID, nearest distance
+ */
+#define kAttractorStatsPlanes (2*MAX_FLOCKS + 2)
+
+/*
+ * Clusters (9th outlet), the connected components of the neighbor relation, one row per cluster:
+ * size, centroid x y z, mean heading x y z, flock of its first boid
+ */
+#define kClusterPlanes 8
+
+/*
+ * Spatial queries (12th outlet), answered at the next output
+ */
+#define kQueryNone 0 // nothing waiting
+#define kQueryRadius 1 // the boids within a radius of a point
+#define kQueryKNN 2 // the k boids nearest to a point
+
+/*
+ * Frame budget degradation levels, applied in order while FlightStep is over budget:
+ *      1 = cap the neighbors per boid,
+ *      2 = also refresh the neighbor search of each boid only every 2nd step,
+ *      3 = tighter cap and refresh only every 4th step
+ */
+#define kNumBudgetLevels 4
+static const int kBudgetNeighborCap[kNumBudgetLevels] = {0, 32, 32, 16}; // 0 = no cap
+static const int kBudgetStagger[kNumBudgetLevels] = {1, 1, 2, 4};
+#define kBudgetSettleFrames 8 // frames to wait at a level before degrading further
+#define kBudgetRecoverFrames 60 // frames well under budget before restoring a level
+#define kBudgetRecoverRatio 0.5 // "well under budget"
+
+/*
+ * Asynchronous simulation thread
+ */
+#define kSimFresh 4 // flag on simMiddle: a frame was published since the output last took one
+#define kMinSimRate 1.0 // steps per second
+#define kMaxSimRate 1000.0
+#define kMaxCatchUpSteps 4 // most fixed steps taken for one output, time beyond that is dropped
+
+/*
+ * Fields the 1st outlet can output (outputplanes), in the order of kOutputFieldNames
+ */
+#define kFieldPosition 0 // x, y, z
+#define kFieldFlockID 1
+#define kFieldOldPosition 2 // x, y, z of the step before
+#define kFieldSpeed 3 // length of the last step
+#define kFieldAzimuth 4 // degrees
+#define kFieldElevation 5 // degrees
+#define kFieldVelocity 6 // x, y, z of the last step
+#define kFieldAge 7
+#define kFieldGlobalID 8
+#define kFieldDirection 9 // x, y, z of the unit heading
+#define kFieldTexcoord 10 // s, t, always 0: holds the place of the texture coordinates in a geometry matrix
+#define kFieldColor 11 // r, g, b, a from the color of the flock (flockcolor)
+#define kFieldQuat 12 // x, y, z, w of the rotation from +z to the heading
+#define kFieldScale 13 // x, y, z, all the scale of the flock (flockscale)
+#define kFieldCluster 14 // row of the boid's cluster in the 9th outlet, -1 before clustering is on
+#define kFieldLOD 15 // level of detail, the lod distances closer to the camera than the boid
+#define kNumOutputFields 16
+static const char *kOutputFieldNames[kNumOutputFields] = {"position", "flockid", "oldposition", "speed", "azimuth", "elevation", "velocity", "age", "globalid", "direction", "texcoord", "color", "quat", "scale", "cluster", "lod"};
+static const int kOutputFieldPlanes[kNumOutputFields] = {3, 1, 3, 1, 1, 1, 3, 1, 1, 3, 2, 4, 4, 3, 1, 1};
+#define kMaxOutputFields 16 // fields listed in outputplanes
+#define kMaxOutputPlanes 16 // planes of the 1st outlet, twice that many char planes as float16
+
+/*
+ * Packing of the 1st outlet when the render mirror can't be copied
+ */
+#define kPackRowBoids 64 // boids per row handed to a packing worker
+#define kParallelPackBoids 512 // fewer boids than this are packed on the calling thread
+#define kMaxDensitySize 32 // voxels along each axis of the density grid (10th outlet)
+#define kMaxDensityVoxels (kMaxDensitySize*kMaxDensitySize*kMaxDensitySize)
+#define kDensityPartials 8 // slices of the boids, each splatted into a grid of its own by a worker
+#define kDensityGaussRadius 2 // voxels on each side of the center of the gaussian kernel, sigma is 1 voxel
+#define kMaxTrailLength 64 // positions each boid remembers for the 11th outlet
+#define kDepthSortChunks 8 // slices of the boids whose depth digits one worker counts and scatters
+#define kDepthSortRadix 256 // values of a digit, 2 digits make a depth key
+#define kMaxLODLevels 4 // distances of the lod attribute
 
 /*
   * Initial flight parameters
@@ -51,6 +166,11 @@ const double kFlyRectRight = 1.0;
 const double kFlyRectFront = 1.0;
 const double kFlyRectBack = -1.0;
 const double kFlyRectScalingFactor = 10;
+const double kDefaultSimRate = 60.0;
+const double kFlockColors[MAX_FLOCKS][4] = { //the flock colors of the control panel patch
+    {1.0, 0.5, 0.5, 1.0}, {0.5, 1.0, 1.0, 1.0}, {1.0, 1.0, 0.5, 1.0},
+    {0.5, 0.5, 1.0, 1.0}, {0.5, 1.0, 0.5, 1.0}, {1.0, 0.5, 0.5, 1.0}
+};
 
 /*
   * NOTE: #define is used instead of strcuts for the sake of Max's Jitter object
@@ -77,6 +197,17 @@ const double kFlyRectScalingFactor = 10;
 #define front 4
 #define back 5
 
+/*!
+ * @typedef AttractorStats
+ * @brief Boids around one attractor, collected by SeekAttractors as FlightStep finishes each boid
+ */
+typedef struct AttractorStats {
+    int count[MAX_FLOCKS]; //boids of each flock inside the radius
+    double distSum[MAX_FLOCKS]; //their distances to the attractor
+    double nearestDist;
+    int nearestID; //globalID of the nearest boid of any flock, -1 if there are no boids
+} AttractorStats;
+
 /*!
   * @typedef Attractor
   * @brief Struct for one attractor object, which will be contained in LinkedList of boids
@@ -87,6 +218,9 @@ typedef struct Attractor {
     double attractorRadius; // Attraction radius of attractor
     int id;
     int onlyAttractedFlockID; //-1 if all flocks feel the attractor, otherwise the ID of the only flock that will feel this attractor
+    AttractorStats stepStats; //being collected by the current step
+    AttractorStats stats; //of the last step, for the 3rd outlet
+    AttractorStats frameStats[3]; //stats as packed into each SimFrame, by the index of the frame
 } Attractor, *AttractorPtr;
 
 /*
@@ -111,6 +245,21 @@ typedef struct Boid {
     double speed;
     long neighbor[kMaxNeighbors];
     double neighborDistSqr[kMaxNeighbors];
+    
+    //last result of the neighbor search, reused by staggered budget levels
+    double neighborCenter[3];
+    double neighborMatch[3];
+    double neighborSeparation[3];
+    long neighborStep; //step the result was computed in, -1 if never
+    
+    int clusterSlot; //node in the union-find of the step, -1 if none
+    int clusterID; //row in the cluster summary, -1 if never labeled
+    
+    int trailSlot; //ring buffer of the last positions in trails, -1 if every slot was taken
+    char trailFilled; //if the ring buffer holds positions of this boid, a new trail starts filled with the first one
+    
+    int packRow; //row of the 1st outlet in the last output, -1 if culled
+    
     struct Boid *nextBoid;
 } Boid, *BoidPtr;
 
@@ -129,8 +278,91 @@ typedef struct NeighborLine {
     
     int flockID[2]; //[boidAflockID, boidBflockID]
     
+    int index[2]; //rows of boid A and B in the 1st outlet, -1 if not output; set when lineoutput is on
+    
 } NeighborLine, *NeighborLinePtr;
 
+
+/*!
+ * @typedef BoidRow
+ * @brief The row of a boid in the 1st outlet, sorted by global id to look up the ends of neighbor lines
+ */
+typedef struct BoidRow {
+    
+    int globalID;
+    int row;
+    
+} BoidRow;
+
+
+/*
+ * @typedef TraceEvent
+ * @brief One event of a Chrome trace recording; stored in a preallocated array and written out by TraceStop()
+ */
+typedef struct TraceEvent {
+    
+    const char *name; //static string, never freed
+    char phase; //'B'egin, 'E'nd, 'i'nstant or 'C'ounter
+    double ts; //microseconds since the trace started
+    t_systhread thread; //thread the event was recorded on
+    float args[kNumProfilePhases]; //phase times in ms for counter events
+    
+} TraceEvent, *TraceEventPtr;
+
+
+/*!
+ * @typedef FlockStats
+ * @brief Sums over the boids of one flock, collected as FlightStep finishes each boid
+ */
+typedef struct FlockStats {
+    
+    long count;
+    double posSum[3];
+    double posSqrSum[3];
+    double min[3];
+    double max[3];
+    double speedSum; //length of the step
+    double dirSum[3]; //unit headings, for the polarization
+    double velSum[3];
+    double posCrossVelSum[3]; //position x step, for the angular momentum about the centroid
+    
+} FlockStats;
+
+
+/*!
+ * @typedef SimFrame
+ * @brief A finished simulation step, packed for output by the asynchronous simulation thread
+ *        and handed to matrix_calc through a triple buffer
+ */
+typedef struct SimFrame {
+    
+    int index; //in simFrames, also the slot of the attractors' frameStats (3rd outlet)
+    long numBoids;
+    long planecount; //planes per boid in boids, from the mode the frame was packed in
+    float boids[kMaxNumBoids*kMaxOutputPlanes]; //1st outlet
+    int boidCount[MAX_FLOCKS]; //2nd outlet
+    long countsVersion; //countsVersion of boidCount
+    long numLines;
+    NeighborLine lines[kMaxNeighborLines]; //4th outlet
+    float timing[kNumProfilePhases][4]; //5th outlet: last, mean, p95, p99
+    long neighborHistogram[MAX_FLOCKS][kHistogramBins]; //6th outlet
+    long candidateHistogram[MAX_FLOCKS][kHistogramBins];
+    long flockRanges[MAX_FLOCKS][2]; //7th outlet
+    FlockStats flockStats[MAX_FLOCKS]; //8th outlet
+    long numClusters;
+    float clusterSummary[kMaxNumBoids][kClusterPlanes]; //9th outlet
+    long densitySize;
+    float *density; //10th outlet, kMaxDensityVoxels allocated by SimPackFrame the first time the grid is on
+    long trailLength;
+    long trailBoids; //the rows of the 1st outlet
+    float *trail; //11th outlet, trailLength rows of trailBoids
+    long trailCapacity; //floats allocated in trail by SimPackFrame
+    long queryVersion; //queryVersion of queryResult
+    long queryCount;
+    float queryResult[kMaxNumBoids][3]; //12th outlet
+    
+} SimFrame, *SimFramePtr;
+
 /*!
  * @typedef _jit_boids3d
  * @brief Struct for the actual jitter object holding LinkedList of boids, attractors, etc.
@@ -145,6 +377,12 @@ typedef struct _jit_boids3d
     double flyrect[6]; // dimensions of the simulation
     long flyRectCount;
     char allowNeighborsFromDiffFlock; // bool, if boids can find neighbors that are in another flock
+    
+    // Interactions between flocks, [flock of the boid][flock of the neighbor]
+    char flockSees[MAX_FLOCKS][MAX_FLOCKS]; // 1 or 0, -1 to see the own flock and the others as diffFlock says
+    double flockWeights[MAX_FLOCKS][MAX_FLOCKS][3]; // of a neighbor in cohesion, alignment and separation
+    long interactionCount;
+    double flockBounds[MAX_FLOCKS][6]; // min x y z, max x y z of every position a boid can have in this step
     double birthLoc[3]; // birth location of boids, default is {0,0,0}
     int newBoidID;
     
@@ -163,17 +401,178 @@ typedef struct _jit_boids3d
     double accel[MAX_FLOCKS];
     double neighborRadius[MAX_FLOCKS];
     double age[MAX_FLOCKS];
+    double flockColor[MAX_FLOCKS][4]; // r, g, b, a of the color field
+    double flockScale[MAX_FLOCKS]; // of the scale field
     double tempCenterPt[3];
     long centerPtCount;
     
     NeighborLinePtr neighborhoodConnections[kMaxNeighborLines]; // Array to hold lines between neighbors
     long sizeOfNeighborhoodConnections;
     int drawingNeighbors; //boolean to avoid computing neighbor lines if we are not drawing neighbors
+    char lineOutput; // 4th outlet: 0 = endpoint positions, 1 = index pairs into the 1st outlet (long), 2 = index pairs and weight (float32)
+    BoidRow lineRows[kMaxNumBoids]; // scratch of LineIndexUpdate
     
     BoidPtr flockLL[MAX_FLOCKS]; // Array holding at most 6 LinkedLists of flocks
     AttractorPtr attractorLL; // Array holding at most 6 LinkedLists of attractors
     
     int tempForStats[1]; //?
+    long goldenArgs[4]; // [frames, boids per flock, seed, record] of the last golden run
+    t_symbol *goldenDir; // folder of the stored golden trajectories, none = the Max folder
+    char flockSkipOff; // bool, tests the boids of every flock one by one, the reference kernel of the golden harness
+    
+    // Per-phase frame timing
+    char profiling; // bool, if the phases of each frame are timed
+    double phaseTime[kNumProfilePhases]; // ms spent in each phase during the current frame
+    double phaseHistory[kNumProfilePhases][kProfileWindow]; // ring buffer of the last frames, in ms
+    long profileFrames; // number of frames recorded in phaseHistory
+    char profileSample; // bool, if the boid being stepped is one of the timed samples
+    double sampleTime[kNumProfilePhases]; // ms spent in each per-boid phase by the sampled boids of the current step
+    
+    // Chrome trace recording
+    char tracing; // bool, if events are being recorded
+    t_symbol *traceFile; // file the trace is written to when it stops
+    TraceEventPtr traceEvents; // kMaxTraceEvents slots, allocated while a trace is open
+    t_int32_atomic traceClaimed; // slots handed out to writers, may exceed kMaxTraceEvents (dropped events)
+    t_int32_atomic traceCommitted; // slots completely written
+    t_int32_atomic traceWriters; // writers between their tracing check and the end of their event, the buffer is freed at 0
+    double traceStart; // systimer_gettime() when the trace started
+    
+    // Neighbor density histograms, per flock
+    char histogramming; // bool, if the histograms are collected
+    long neighborHistogram[MAX_FLOCKS][kHistogramBins]; // neighbors found per boid in the last step
+    long candidateHistogram[MAX_FLOCKS][kHistogramBins]; // candidates tested per boid in the last step, after the flock skip
+    
+    // Per-flock statistics
+    char flockStatsOn; // bool, if the statistics are collected
+    FlockStats flockStats[MAX_FLOCKS]; // of the last step
+    
+    // Attractor statistics
+    char attractorStatsOn; // bool, if the attractor statistics are collected
+    
+    // Side outputs the step in progress builds, fixed when it starts so attributes changed during a step
+    // (or a fast-forward) only apply from the next one
+    char stepLines;
+    char stepHistograms;
+    char stepFlockStats;
+    char stepClusters;
+    char stepAttractorStats;
+    char stepDensity;
+    
+    // Clusters, the connected components of the neighbor relation
+    char clustering; // bool, if the clusters are labeled
+    int clusterParent[kMaxNumBoids]; // union-find over the slots of the step
+    int clusterSize[kMaxNumBoids]; // boids under a root slot
+    int clusterOfRoot[kMaxNumBoids]; // cluster of a root slot while labeling, -1 if none yet
+    long numClusters;
+    float clusterSummary[kMaxNumBoids][kClusterPlanes]; // of the last step
+    
+    // Density grid over the flyrect, x fastest then y then z
+    long densitySize; // voxels along each axis, 0 if off
+    char densityKernel; // 0 trilinear, 1 gaussian
+    float *density; // of the last step, kMaxDensityVoxels allocated the first time the grid is turned on
+    float (*densityPartials)[kMaxDensityVoxels]; // kDensityPartials grids summed into density, allocated with it
+    BoidPtr densityBoids[kMaxNumBoids]; // the boids being splatted
+    long densityCount;
+    double densityOrigin[3]; // corner of the flyrect with the lowest coordinates
+    double densityScale[3]; // voxels per unit along each axis
+    
+    // Trails
+    long trailLength; // positions kept per boid, 0 if off
+    long trailHead; // slot of the ring buffers the current step writes
+    float *trails; // kMaxNumBoids ring buffers of trailLength positions, allocated while the trails are on
+    int trailFreeSlots[kMaxNumBoids]; // ring buffers given back by boids that died
+    long trailFreeCount;
+    long trailSlotsUsed; // ring buffers ever handed out, the next one is new
+    
+    // Spatial queries
+    char queryKind; // kQueryRadius or kQueryKNN while waiting for the next output, then kQueryNone
+    double queryArgs[4]; // x, y, z and the radius or k of the last query
+    long queryArgCount;
+    long queryCount; // boids the last query found
+    float queryResult[kMaxNumBoids][3]; // row of the 1st outlet (-1 if culled), globalID, distance, the nearest first
+    
+    // Adaptive frame budget
+    double budget; // ms FlightStep may take, 0 = off
+    long budgetLevel; // current degradation level, see kBudgetNeighborCap/kBudgetStagger
+    double budgetSmoothed; // smoothed FlightStep time in ms
+    long budgetFramesAtLevel; // frames since the level last changed
+    long stepCount; // number of steps taken
+    
+    // Asynchronous simulation thread
+    char async; // bool, if the simulation steps on its own thread instead of on each output
+    double simRate; // steps per second of the simulation thread
+    t_systhread simThread; // NULL while no thread is running
+    t_systhread_mutex simLock; // serializes steps against changes to the linked lists
+    volatile char simQuit; // asks the simulation thread to return
+    SimFramePtr simFrames[3]; // triple buffer, allocated the first time the thread starts
+    int simBack; // frame being packed, owned by the simulation thread
+    t_int32_atomic simMiddle; // last published frame, | kSimFresh until the output takes it
+    int simFront; // frame being output, owned by matrix_calc
+    
+    // Fixed timestep
+    char fixedStep; // bool, if the output steps the simulation at simRate instead of once per output
+    double stepAccumulator; // ms of elapsed time not simulated yet
+    double lastOutputTime; // systimer_gettime() of the last output, 0 = none since fixedstep was turned on
+    double stepAlpha; // where the output positions lie between oldPos (0) and newPos (1)
+    
+    // Fields of the 1st outlet
+    t_symbol *outputPlanes[kMaxOutputFields]; // field names set by outputplanes, none = the bundle of the mode
+    long outputPlanesCount;
+    char outputFields[kMaxOutputFields]; // kField constants actually output
+    long numOutputFields;
+    long outputPlanecount; // planes of those fields
+    long outputLayout; // changes whenever the fields change
+    
+    // Change tracking of the side outlets, rebuilt only when their version moved since the last output
+    long countsVersion; // changes whenever boidCount changes (2nd outlet)
+    long attractorsVersion; // changes whenever an attractor is added, moved or deleted (3rd outlet)
+    long outputCountsVersion; // countsVersion the 2nd outlet holds
+    long outputAttractorsVersion; // attractorsVersion the 3rd outlet holds
+    long queryVersion; // changes with every query answered (12th outlet)
+    long outputQueryVersion; // queryVersion the 12th outlet holds
+    
+    // Info of the output matrices as last set or read, valid while the matrix and its data are the same
+    void *outputMatrix[kNumOutlets];
+    char *outputData[kNumOutlets];
+    t_jit_matrix_info outputInfo[kNumOutlets];
+    
+    // Half-float output of the 1st outlet
+    char halfOutput; // bool, if the 1st outlet is float16, sent as 2 char planes per plane
+    float halfStaging[kMaxNumBoids*kMaxOutputPlanes]; // the float32 planes before conversion
+    
+    // Render mirror of the 1st outlet
+    float renderMirror[kMaxNumBoids*kMaxOutputPlanes]; // written by FlightStep in the layout of the 1st outlet
+    long mirrorCount; // boids in renderMirror
+    long mirrorPlanecount; // planes per boid in renderMirror, 0 = out of date
+    long mirrorLayout; // outputLayout renderMirror was written with
+    BoidPtr packBoids[kMaxNumBoids]; // boids in output order, for packing without the mirror
+    long flockRanges[MAX_FLOCKS][2]; // offset and count of each flock in packBoids, -1 -1 while depthsort mixes them
+    long packCount;
+    char *packBase; // start of the matrix being packed
+    
+    // Depth sorting of the 1st outlet
+    char depthSort; // bool, if the 1st outlet goes from the farthest boid to the nearest
+    double camera[6]; // position x y z, view direction x y z
+    long cameraCount;
+    unsigned short sortKeys[2][kMaxNumBoids]; // quantized depths of packBoids and of sortBoids
+    BoidPtr sortBoids[kMaxNumBoids]; // the boids scattered by the current pass
+    long sortOffsets[kDepthSortChunks][kDepthSortRadix]; // digits counted per slice, then where the slice scatters them
+    int sortShift; // digit of the current pass
+    
+    // Culling and level of detail of the 1st outlet
+    char culling; // bool, if the boids outside the frustum of the camera are left out
+    double frustum[4]; // vertical field of view in degrees, aspect ratio, near and far distance
+    long frustumCount;
+    double viewBasis[3][3]; // right, up and forward of the camera, while gathering
+    double lodDistances[kMaxLODLevels]; // increasing distances from the camera where the lod field steps up
+    long lodCount;
+    
+    // Fast-forward and warm-up
+    long fastForward; // steps of the last step message
+    long warmupSteps; // steps of the last warm-up
+    t_systhread warmupThread; // NULL when no warm-up was started since the last join
+    volatile char warming; // bool, set while the warm-up thread is stepping; the outputs are left untouched
+    volatile char warmupQuit; // asks the warm-up thread to return early
     
     // Setting angle of velocity
     double 			d2r; // Degrees --> Radians
@@ -193,12 +592,24 @@ t_jit_err jit_boids3d_matrix_calc(t_jit_boids3d *flockPtr, void *inputs, void *o
 
 void jit_boids3d_calculate_ndim(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
                                 t_jit_matrix_info *out_minfo, char *bop);
+void jit_boids3d_calculate_rows(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                                t_jit_matrix_info *out_minfo, char *bop);
+void PackBoid(t_jit_boids3d *flockPtr, BoidPtr theBoid, double alpha, float *fop);
+void HeadingQuat(double *dir, float *quat);
+void LineIndexUpdate(t_jit_boids3d *flockPtr);
+char OutputMatrixInfo(void *matrix, t_jit_matrix_info *info, long width, long height, t_symbol *type, long planecount);
+void OutputMatrixGetInfo(t_jit_boids3d *flockPtr, int outlet, void *matrix, t_jit_matrix_info *info, char **data);
+void OutputMatrixGetData(t_jit_boids3d *flockPtr, int outlet, void *matrix, t_jit_matrix_info *info, char **data);
+long OutputPlanecount(t_jit_boids3d *flockPtr);
+void OutputLayoutUpdate(t_jit_boids3d *flockPtr);
 
 //Attribute methods
 /*
  These are the method that will get called when a message is received from the Max patch
  ie) [pak age 0. 0.] -> will call the jit_boids3d_age() method
  */
+t_jit_err jit_boids3d_mode(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
+t_jit_err jit_boids3d_outputplanes(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //fields output by the 1st outlet
 t_jit_err jit_boids3d_neighbors(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
 t_jit_err jit_boids3d_minspeed(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
 t_jit_err jit_boids3d_nradius(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
@@ -213,12 +624,30 @@ t_jit_err jit_boids3d_sepdist(t_jit_boids3d *flockPtr, void *attr, long argc, t_
 t_jit_err jit_boids3d_speed(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
 t_jit_err jit_boids3d_accel(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
 t_jit_err jit_boids3d_age(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
+t_jit_err jit_boids3d_flockcolor(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //color of a flock in the color field
+t_jit_err jit_boids3d_flockscale(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //scale of a flock in the scale field
+t_jit_err jit_boids3d_interaction(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //how the boids of a flock see another flock
+t_jit_err jit_boids3d_density(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //voxels along each axis of the density grid
+t_jit_err jit_boids3d_trail(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //positions kept per boid
+t_jit_err jit_boids3d_query_radius(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //boids within a radius of a point
+t_jit_err jit_boids3d_query_knn(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //boids nearest to a point
+int CompareQueryRows(const void *a, const void *b);
 t_jit_err jit_boids3d_attractpt(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
 t_jit_err jit_boids3d_addattractor(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
 t_jit_err jit_boids3d_deleteattractor(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
 t_jit_err jit_boids3d_birthloc(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv);
 t_jit_err jit_boids3d_stats(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //posts various stats to the max console
+t_jit_err jit_boids3d_halfreport(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //posts the float16 error of the output fields
 t_jit_err jit_boids3d_drawingneighbors(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //0/1 if the max patch wants to draw neighbors
+t_jit_err jit_boids3d_golden(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //runs the golden-trajectory regression harness
+t_jit_err jit_boids3d_profile(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //0/1 to time the phases of each frame
+t_jit_err jit_boids3d_trace(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //starts a trace into a file, or stops it when empty
+t_jit_err jit_boids3d_budget(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //ms budget of a step, 0 = off
+t_jit_err jit_boids3d_async(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //0/1 to step on a separate thread
+t_jit_err jit_boids3d_simrate(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //steps per second of that thread or of fixedstep
+t_jit_err jit_boids3d_fixedstep(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //0/1 to step at simrate and interpolate the output
+t_jit_err jit_boids3d_step(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //runs n steps without output
+t_jit_err jit_boids3d_warmup(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv); //runs n steps on a background thread
 
 
 //Initialization methods
@@ -229,19 +658,118 @@ AttractorPtr InitAttractor(t_jit_boids3d *flockPtr);
 NeighborLinePtr InitNeighborhoodLine(t_jit_boids3d *flockPtr, BoidPtr theBoid, BoidPtr theOtherBoid);
 
 //Methods for running the simulation
-void FlightStep(t_jit_boids3d *flockPtr);
+void FlightStep(t_jit_boids3d *flockPtr, char sideOutputs);
 void CalcFlockCenterAndNeighborVel(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *matchNeighborVel, double *separationNeighborVel);
+char FlockSees(t_jit_boids3d *flockPtr, int observer, int seen);
+void FlockBoundsUpdate(t_jit_boids3d *flockPtr);
+double FlockBoundsDist(t_jit_boids3d *flockPtr, int flockID, double *pos);
 void SeekPoint(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *seekPt, double* seekDir);
 void SeekAttractors(t_jit_boids3d *flockPtr, BoidPtr theBoid, double* seekDir);
 void AvoidWalls(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *wallVel);
 char InFront(BoidPtr theBoid, BoidPtr neighbor);
 int CalcNumBoids(t_jit_boids3d *flockPtr);
+int FixedStepCount(t_jit_boids3d *flockPtr);
+void BudgetUpdate(t_jit_boids3d *flockPtr, double stepTime);
 
 //Helper methods
 void NormalizeVelocity(double *direction);
+void InterpolatePos(BoidPtr theBoid, double alpha, double *pos);
 double RandomInt(double minRange, double maxRange);
 double DistSqrToPt(double *firstPoint, double *secondPoint);
 
+//Profiling methods
+double ProfileBegin(t_jit_boids3d *flockPtr);
+void ProfileEnd(t_jit_boids3d *flockPtr, int phase, double start);
+double ProfileSampleBegin(t_jit_boids3d *flockPtr);
+void ProfileSampleEnd(t_jit_boids3d *flockPtr, int phase, double start);
+void ProfileSampleCommit(t_jit_boids3d *flockPtr, double loopStart);
+void ProfileCommitFrame(t_jit_boids3d *flockPtr);
+void ProfileSummary(t_jit_boids3d *flockPtr, int phase, double *mean, double *p95, double *p99);
+void ProfileFillTiming(t_jit_boids3d *flockPtr, float *data);
+
+//Trace methods
+void TraceStart(t_jit_boids3d *flockPtr, t_symbol *file);
+void TraceStop(t_jit_boids3d *flockPtr);
+void TraceRecord(t_jit_boids3d *flockPtr, const char *name, char phase);
+void TraceCounters(t_jit_boids3d *flockPtr);
+TraceEventPtr TraceClaim(t_jit_boids3d *flockPtr);
+void TraceRelease(t_jit_boids3d *flockPtr, TraceEventPtr event);
+
+//Asynchronous simulation thread
+void SimStart(t_jit_boids3d *flockPtr);
+void SimStop(t_jit_boids3d *flockPtr);
+void *SimThreadProc(t_jit_boids3d *flockPtr);
+void SimPackFrame(t_jit_boids3d *flockPtr, SimFramePtr frame);
+void SimPublish(t_jit_boids3d *flockPtr);
+SimFramePtr SimAcquire(t_jit_boids3d *flockPtr);
+
+//Per-flock statistics
+void FlockStatsClear(FlockStats *stats);
+void FlockStatsAdd(FlockStats *stats, BoidPtr theBoid);
+void FlockStatsFill(FlockStats *stats, float *out);
+
+//Attractor statistics
+void AttractorStatsClear(AttractorStats *stats);
+void AttractorStatsAdd(AttractorStats *stats, BoidPtr theBoid, double dist, double radius);
+
+//Density grid
+void DensityUpdate(t_jit_boids3d *flockPtr);
+void DensitySplat(t_jit_boids3d *flockPtr, BoidPtr theBoid, float *grid);
+void jit_boids3d_density_partials(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                                  t_jit_matrix_info *minfo, char *bop);
+void jit_boids3d_density_reduce(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                                t_jit_matrix_info *minfo, char *bop);
+
+//Culling and level of detail
+long PackGather(t_jit_boids3d *flockPtr);
+long PackOrder(t_jit_boids3d *flockPtr);
+void QueryRun(t_jit_boids3d *flockPtr);
+long QueryHeapAdd(float (*heap)[3], long count, long k, const float *row);
+char InFrustum(t_jit_boids3d *flockPtr, double *pos);
+int BoidLOD(t_jit_boids3d *flockPtr, double *pos);
+
+//Depth sorting
+void DepthSort(t_jit_boids3d *flockPtr);
+void jit_boids3d_sort_count(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                            t_jit_matrix_info *minfo, char *bop);
+void jit_boids3d_sort_scatter(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                              t_jit_matrix_info *minfo, char *bop);
+
+//Trails
+int TrailClaim(t_jit_boids3d *flockPtr);
+void TrailRelease(t_jit_boids3d *flockPtr, BoidPtr theBoid);
+void TrailAdd(t_jit_boids3d *flockPtr, BoidPtr theBoid);
+void TrailPack(t_jit_boids3d *flockPtr, char *bop, long rowStride);
+
+//Clusters
+void ClusterBegin(t_jit_boids3d *flockPtr);
+void ClusterUnion(t_jit_boids3d *flockPtr, int slotA, int slotB);
+int ClusterFind(t_jit_boids3d *flockPtr, int slot);
+void ClusterLabel(t_jit_boids3d *flockPtr);
+
+//Half-float output
+half FloatToHalf(float value);
+void FloatsToHalves(const float *src, half *dst, long count);
+
+//Fast-forward and warm-up
+void FastForward(t_jit_boids3d *flockPtr, long steps, volatile char *quit);
+void WarmupStop(t_jit_boids3d *flockPtr);
+void *WarmupThreadProc(t_jit_boids3d *flockPtr);
+
+//Golden-trajectory regression harness
+t_jit_boids3d *GoldenInitScenario(t_jit_boids3d *flockPtr, long boidsPerFlock, unsigned long seed);
+void GoldenFreeScenario(t_jit_boids3d *sim);
+void GoldenRecordFrame(t_jit_boids3d *sim, double *frame);
+void GoldenRestoreFrame(t_jit_boids3d *sim, double *frame);
+void GoldenBudgetLevel(t_jit_boids3d *sim, long level);
+void GoldenNoFlockSkip(t_jit_boids3d *sim, long level);
+void GoldenOutputCheck(t_jit_boids3d *sim, double *reference, long frames, long frameSize, long output, double tolerance);
+unsigned long GoldenParamsHash(t_jit_boids3d *sim);
+void GoldenPath(t_jit_boids3d *flockPtr, unsigned long seed, char *path);
+char GoldenLoad(const char *path, long frames, long boidsPerFlock, unsigned long params, double *reference, long frameSize);
+void GoldenSave(const char *path, long frames, long boidsPerFlock, unsigned long params, double *reference, long frameSize);
+double GoldenRandom(unsigned long *state);
+
 
 /*
     Initializes the jitter object
@@ -249,7 +777,7 @@ double DistSqrToPt(double *firstPoint, double *secondPoint);
 t_jit_err jit_boids3d_init(void)
 {
     long attrflags=0;
-    t_jit_object *attr,*mop,*o, *o2, *o3, *o4; //o, o2, and o3 are the 3 outlets. Mop stands for a matrix in jitter
+    t_jit_object *attr,*mop,*o, *o2, *o3, *o4, *o5, *o6, *o7, *o8, *o9, *o10, *o11, *o12; //o through o12 are the 12 outlets. Mop stands for a matrix in jitter
     t_symbol *atsym;
     
     atsym = gensym("jit_attr_offset");
@@ -259,15 +787,31 @@ t_jit_err jit_boids3d_init(void)
                                        sizeof(t_jit_boids3d),0L);
     
     //add mop
-    mop = jit_object_new(_jit_sym_jit_mop,0,4); //object will have 0 inlets and 3 outlets
+    mop = jit_object_new(_jit_sym_jit_mop,0,12); //object will have 0 inlets and 12 outlets
     o = jit_object_method(mop,_jit_sym_getoutput,1); //first outlet
     o2 = jit_object_method(mop,_jit_sym_getoutput,2); //second outlet
     o3 = jit_object_method(mop,_jit_sym_getoutput,3); //third outlet
     o4 = jit_object_method(mop,_jit_sym_getoutput,4); //fourth outlet
+    o5 = jit_object_method(mop,_jit_sym_getoutput,5); //fifth outlet (frame timing)
+    o6 = jit_object_method(mop,_jit_sym_getoutput,6); //sixth outlet (neighbor density histograms)
+    o7 = jit_object_method(mop,_jit_sym_getoutput,7); //seventh outlet (offset and count of each flock in the first outlet)
+    o8 = jit_object_method(mop,_jit_sym_getoutput,8); //eighth outlet (per-flock statistics)
+    o9 = jit_object_method(mop,_jit_sym_getoutput,9); //ninth outlet (cluster summary)
+    o10 = jit_object_method(mop,_jit_sym_getoutput,10); //tenth outlet (density grid)
+    o11 = jit_object_method(mop,_jit_sym_getoutput,11); //eleventh outlet (trails)
+    o12 = jit_object_method(mop,_jit_sym_getoutput,12); //twelfth outlet (query results)
     jit_attr_setlong(o,_jit_sym_dimlink,0);
     jit_attr_setlong(o2,_jit_sym_dimlink,0);
     jit_attr_setlong(o3,_jit_sym_dimlink,0);
     jit_attr_setlong(o4,_jit_sym_dimlink,0);
+    jit_attr_setlong(o5,_jit_sym_dimlink,0);
+    jit_attr_setlong(o6,_jit_sym_dimlink,0);
+    jit_attr_setlong(o7,_jit_sym_dimlink,0);
+    jit_attr_setlong(o8,_jit_sym_dimlink,0);
+    jit_attr_setlong(o9,_jit_sym_dimlink,0);
+    jit_attr_setlong(o10,_jit_sym_dimlink,0);
+    jit_attr_setlong(o11,_jit_sym_dimlink,0);
+    jit_attr_setlong(o12,_jit_sym_dimlink,0);
     
     
     jit_class_addadornment(_jit_boids3d_class,mop);
@@ -280,7 +824,27 @@ t_jit_err jit_boids3d_init(void)
     
     //mode
     attr = jit_object_new(atsym,"mode",_jit_sym_char,attrflags,
-                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,mode));
+                          (method)0L,(method)jit_boids3d_mode,calcoffset(t_jit_boids3d,mode));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //fields of the 1st outlet, overrides mode
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"outputplanes",_jit_sym_symbol,kMaxOutputFields,attrflags,
+                          (method)0L,(method)jit_boids3d_outputplanes,calcoffset(t_jit_boids3d,outputPlanesCount),calcoffset(t_jit_boids3d,outputPlanes));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //color of each flock in the color field
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"flockcolor",_jit_sym_float64,5,attrflags,
+                          (method)0L,(method)jit_boids3d_flockcolor,calcoffset(t_jit_boids3d,flockColor));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //scale of each flock in the scale field
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"flockscale",_jit_sym_float64,2,attrflags,
+                          (method)0L,(method)jit_boids3d_flockscale,calcoffset(t_jit_boids3d,flockScale));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //float16 1st outlet
+    attr = jit_object_new(atsym,"halfoutput",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,halfOutput));
     jit_class_addattr(_jit_boids3d_class,attr);
     
     //allow boids from diff flocks
@@ -288,6 +852,11 @@ t_jit_err jit_boids3d_init(void)
                           (method)0L,(method)0L,calcoffset(t_jit_boids3d,allowNeighborsFromDiffFlock));
     jit_class_addattr(_jit_boids3d_class,attr);
     
+    //interactions between flocks
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"interaction",_jit_sym_float64,6,attrflags,
+                          (method)0L,(method)jit_boids3d_interaction,calcoffset(t_jit_boids3d,interactionCount));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
     //neighbor radius
     attr = jit_object_new(_jit_sym_jit_attr_offset_array,"nradius",_jit_sym_float64,2,attrflags,
                           (method)0L,(method)jit_boids3d_nradius, calcoffset(t_jit_boids3d,neighborRadius));
@@ -388,11 +957,140 @@ t_jit_err jit_boids3d_init(void)
                           (method)0L,(method)jit_boids3d_stats,calcoffset(t_jit_boids3d,tempForStats));
     jit_class_addattr(_jit_boids3d_class,attr);
     
+    //float16 accuracy report
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"halfreport",_jit_sym_float64, 0, attrflags,
+                          (method)0L,(method)jit_boids3d_halfreport,calcoffset(t_jit_boids3d,tempForStats));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
     //doing neighbor lines
     attr = jit_object_new(_jit_sym_jit_attr_offset_array,"drawingneighbors",_jit_sym_long,1,attrflags,
                           (method)0L,(method)jit_boids3d_drawingneighbors,calcoffset(t_jit_boids3d,drawingNeighbors));
     jit_class_addattr(_jit_boids3d_class,attr);
     
+    //layout of the neighbor lines
+    attr = jit_object_new(atsym,"lineoutput",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,lineOutput));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //golden-trajectory regression check
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"golden",_jit_sym_long,4,attrflags,
+                          (method)0L,(method)jit_boids3d_golden,calcoffset(t_jit_boids3d,goldenArgs));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    attr = jit_object_new(atsym,"goldendir",_jit_sym_symbol,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,goldenDir));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //per-phase frame timing
+    attr = jit_object_new(atsym,"profile",_jit_sym_char,attrflags,
+                          (method)0L,(method)jit_boids3d_profile,calcoffset(t_jit_boids3d,profiling));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //chrome trace recording
+    attr = jit_object_new(atsym,"trace",_jit_sym_symbol,attrflags,
+                          (method)0L,(method)jit_boids3d_trace,calcoffset(t_jit_boids3d,traceFile));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //neighbor density histograms
+    attr = jit_object_new(atsym,"histogram",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,histogramming));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //per-flock statistics
+    attr = jit_object_new(atsym,"flockstats",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,flockStatsOn));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //attractor statistics
+    attr = jit_object_new(atsym,"attractorstats",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,attractorStatsOn));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //cluster detection
+    attr = jit_object_new(atsym,"clusters",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,clustering));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //density grid
+    attr = jit_object_new(atsym,"density",_jit_sym_long,attrflags,
+                          (method)0L,(method)jit_boids3d_density,calcoffset(t_jit_boids3d,densitySize));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    attr = jit_object_new(atsym,"densitykernel",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,densityKernel));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //depth sorting
+    attr = jit_object_new(atsym,"depthsort",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,depthSort));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"camera",_jit_sym_float64,6,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,cameraCount),calcoffset(t_jit_boids3d,camera));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //frustum culling and level of detail
+    attr = jit_object_new(atsym,"cull",_jit_sym_char,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,culling));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"frustum",_jit_sym_float64,4,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,frustumCount),calcoffset(t_jit_boids3d,frustum));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"lod",_jit_sym_float64,kMaxLODLevels,attrflags,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,lodCount),calcoffset(t_jit_boids3d,lodDistances));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //trails
+    attr = jit_object_new(atsym,"trail",_jit_sym_long,attrflags,
+                          (method)0L,(method)jit_boids3d_trail,calcoffset(t_jit_boids3d,trailLength));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //spatial queries
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"query_radius",_jit_sym_float64,4,attrflags,
+                          (method)0L,(method)jit_boids3d_query_radius,calcoffset(t_jit_boids3d,queryArgCount),calcoffset(t_jit_boids3d,queryArgs));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    attr = jit_object_new(_jit_sym_jit_attr_offset_array,"query_knn",_jit_sym_float64,4,attrflags,
+                          (method)0L,(method)jit_boids3d_query_knn,calcoffset(t_jit_boids3d,queryArgCount),calcoffset(t_jit_boids3d,queryArgs));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //adaptive frame budget
+    attr = jit_object_new(atsym,"budget",_jit_sym_float64,attrflags,
+                          (method)0L,(method)jit_boids3d_budget,calcoffset(t_jit_boids3d,budget));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //current degradation level (read-only)
+    attr = jit_object_new(atsym,"budgetlevel",_jit_sym_long,JIT_ATTR_GET_DEFER_LOW | JIT_ATTR_SET_OPAQUE_USER,
+                          (method)0L,(method)0L,calcoffset(t_jit_boids3d,budgetLevel));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //asynchronous simulation thread
+    attr = jit_object_new(atsym,"async",_jit_sym_char,attrflags,
+                          (method)0L,(method)jit_boids3d_async,calcoffset(t_jit_boids3d,async));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //steps per second of the simulation thread and of the fixed timestep
+    attr = jit_object_new(atsym,"simrate",_jit_sym_float64,attrflags,
+                          (method)0L,(method)jit_boids3d_simrate,calcoffset(t_jit_boids3d,simRate));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //fixed timestep with interpolated output
+    attr = jit_object_new(atsym,"fixedstep",_jit_sym_char,attrflags,
+                          (method)0L,(method)jit_boids3d_fixedstep,calcoffset(t_jit_boids3d,fixedStep));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //fast-forward
+    attr = jit_object_new(atsym,"step",_jit_sym_long,attrflags,
+                          (method)0L,(method)jit_boids3d_step,calcoffset(t_jit_boids3d,fastForward));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
+    //background warm-up
+    attr = jit_object_new(atsym,"warmup",_jit_sym_long,attrflags,
+                          (method)0L,(method)jit_boids3d_warmup,calcoffset(t_jit_boids3d,warmupSteps));
+    jit_class_addattr(_jit_boids3d_class,attr);
+    
     
     jit_class_register(_jit_boids3d_class); //register the class with Max
     
@@ -419,21 +1117,23 @@ t_jit_err jit_boids3d_init(void)
  */
 t_jit_err jit_boids3d_attractpt(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "attractpt", 'i');
     int attractorID = (int)jit_atom_getfloat(argv+4);
+    systhread_mutex_lock(flockPtr->simLock);
     AttractorPtr iterator = flockPtr->attractorLL;
     while (iterator){
         if(attractorID == iterator->id){
             //this is the attractor we want to modify
-            if(iterator){
-                iterator->loc[0] = (double)jit_atom_getfloat(argv);
-                iterator->loc[1] = (double)jit_atom_getfloat(argv+1);
-                iterator->loc[2] = (double)jit_atom_getfloat(argv+2);
-                iterator->attractorRadius = (double)jit_atom_getfloat(argv+3);
-            }
-            return JIT_ERR_NONE;
+            iterator->loc[0] = (double)jit_atom_getfloat(argv);
+            iterator->loc[1] = (double)jit_atom_getfloat(argv+1);
+            iterator->loc[2] = (double)jit_atom_getfloat(argv+2);
+            iterator->attractorRadius = (double)jit_atom_getfloat(argv+3);
+            flockPtr->attractorsVersion++;
+            break;
         }
         iterator = iterator->nextAttractor;
     }
+    systhread_mutex_unlock(flockPtr->simLock);
     
     return JIT_ERR_NONE;
 }
@@ -446,6 +1146,8 @@ t_jit_err jit_boids3d_attractpt(t_jit_boids3d *flockPtr, void *attr, long argc,
  */
 t_jit_err jit_boids3d_addattractor(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "addattractor", 'B');
+    systhread_mutex_lock(flockPtr->simLock);
     //grab the ID of the new attractor
     int newID = (int)jit_atom_getlong(argv);
     
@@ -457,12 +1159,15 @@ t_jit_err jit_boids3d_addattractor(t_jit_boids3d *flockPtr, void *attr, long arg
     }
     
     flockPtr->numAttractors++;
+    flockPtr->attractorsVersion++;
     
     //no attractors exist
     if(!iterator){
         newAttractor->id = newID;
         flockPtr->attractorLL = newAttractor;
         flockPtr->attractorLL->nextAttractor = NULL;
+        systhread_mutex_unlock(flockPtr->simLock);
+        TraceRecord(flockPtr, "addattractor", 'E');
         return JIT_ERR_NONE;
     }
     
@@ -490,6 +1195,8 @@ t_jit_err jit_boids3d_addattractor(t_jit_boids3d *flockPtr, void *attr, long arg
     }
     newAttractor->nextAttractor = iterator;
     flockPtr->attractorLL = newAttractor;
+    systhread_mutex_unlock(flockPtr->simLock);
+    TraceRecord(flockPtr, "addattractor", 'E');
     return JIT_ERR_NONE;
 }
 
@@ -500,154 +1207,635 @@ t_jit_err jit_boids3d_addattractor(t_jit_boids3d *flockPtr, void *attr, long arg
  */
 t_jit_err jit_boids3d_drawingneighbors(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "drawingneighbors", 'i');
     int draw = (int)jit_atom_getlong(argv);
+    systhread_mutex_lock(flockPtr->simLock);
     flockPtr->drawingNeighbors = draw;
+    systhread_mutex_unlock(flockPtr->simLock);
     
     return JIT_ERR_NONE;
 }
 
 
 /*!
-    @brief Deletes an attractor with given ID
-    @param argv the ID of the attractor to be deleted
+ @brief Selects one of the bundles of fields of the 1st outlet
+ @param argv 0 = position, flockid; 1 = adds oldposition; 2 = adds speed, azimuth, elevation;
+             3 = a Jitter geometry matrix for jit.gl.mesh: position, texcoord, direction as the normal, color;
+             4 = instance transforms for jit.gl.multiple: position, quat, scale
+ @discussion Has no effect on the output while outputplanes lists fields. Other values are rejected.
  */
-t_jit_err jit_boids3d_deleteattractor(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+t_jit_err jit_boids3d_mode(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
-    int attractorID = (int)jit_atom_getlong(argv);
-    AttractorPtr iterator = flockPtr->attractorLL;
-    AttractorPtr prev = iterator;
-    
-    //iterate thru the LL of attractors to find the right one
-    while(iterator){
-        if(iterator->id == attractorID){
-            //this is the attractor to delete
-            if(prev == iterator){ //first attractor
-                iterator = iterator->nextAttractor;
-                free(prev);
-                flockPtr->attractorLL = iterator;
-                
-            }else{
-                
-                //middle or end
-                prev->nextAttractor = iterator->nextAttractor;
-                free(iterator);
-            }
-            
-            //update numAttractors and mark the LL NULL if necessary
-            flockPtr->numAttractors--;
-            if(flockPtr->numAttractors <= 0){
-                flockPtr->attractorLL = NULL;
-            }
-            return JIT_ERR_NONE;
-            
-        }
-        prev = iterator;
-        iterator = iterator->nextAttractor;
+    TraceRecord(flockPtr, "mode", 'i');
+    long mode = jit_atom_getlong(argv);
+    if(mode < 0 || mode > 4){
+        post("ERROR: mode %ld does not exist, the modes are 0 to 4", mode);
+        return JIT_ERR_INVALID_INPUT;
     }
     
-    //couldn't find this attractor
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->mode = (char)mode;
+    OutputLayoutUpdate(flockPtr);
+    systhread_mutex_unlock(flockPtr->simLock);
+    
     return JIT_ERR_NONE;
 }
 
 
-/*
- Following methods update flock-specific attributes
+/*!
+ @brief Lists exactly which fields the 1st outlet outputs, in order
+ @param argv Any of position, flockid, oldposition, speed, azimuth, elevation, velocity, age, globalid,
+             direction, texcoord, color, quat, scale, cluster, lod.
+             No arguments, or no known field, goes back to the bundle of the mode.
+ @discussion Only the listed fields are computed; unknown names and fields past kMaxOutputPlanes are ignored
  */
-
-//---NOT CURRENTLY USED---
-t_jit_err jit_boids3d_neighbors(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+t_jit_err jit_boids3d_outputplanes(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
-    flockPtr->neighbors = (double)MIN(jit_atom_getfloat(argv), kMaxNeighbors);
+    TraceRecord(flockPtr, "outputplanes", 'i');
+    systhread_mutex_lock(flockPtr->simLock);
+    
+    flockPtr->outputPlanesCount = 0;
+    for(long i=0; i<argc && flockPtr->outputPlanesCount < kMaxOutputFields; i++){
+        t_symbol *name = jit_atom_getsym(argv+i);
+        int known = 0;
+        for(int j=0; j<kNumOutputFields; j++){
+            if(name == gensym(kOutputFieldNames[j])){
+                known = 1;
+                break;
+            }
+        }
+        if(!known){
+            post("outputplanes: unknown field %s", name->s_name);
+            continue;
+        }
+        flockPtr->outputPlanes[flockPtr->outputPlanesCount++] = name;
+    }
+    OutputLayoutUpdate(flockPtr);
+    
+    systhread_mutex_unlock(flockPtr->simLock);
     return JIT_ERR_NONE;
 }
-//--------------------------
 
-t_jit_err jit_boids3d_nradius(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+
+/*!
+ @brief Sets the color the color field gives the boids of a flock
+ @param argv r, g, b, a, flockID
+ */
+t_jit_err jit_boids3d_flockcolor(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
-    int flockID = (int)jit_atom_getfloat(argv+1);
-    flockPtr->neighborRadius[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.0);
+    TraceRecord(flockPtr, "flockcolor", 'i');
+    if(argc < 5){
+        return JIT_ERR_NONE;
+    }
+    
+    int flockID = (int)jit_atom_getfloat(argv+4);
+    if(flockID < 0 || flockID >= MAX_FLOCKS){
+        return JIT_ERR_NONE;
+    }
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    for(int i=0; i<4; i++){
+        flockPtr->flockColor[flockID][i] = jit_atom_getfloat(argv+i);
+    }
+    flockPtr->outputLayout++; //the render mirror has the old color
+    systhread_mutex_unlock(flockPtr->simLock);
+    
     return JIT_ERR_NONE;
 }
 
-t_jit_err jit_boids3d_minspeed(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+
+/*!
+ @brief Sets the scale the scale field gives the boids of a flock
+ @param argv scale, flockID
+ */
+t_jit_err jit_boids3d_flockscale(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "flockscale", 'i');
+    if(argc < 2){
+        return JIT_ERR_NONE;
+    }
+    
     int flockID = (int)jit_atom_getfloat(argv+1);
-    flockPtr->minspeed[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    if(flockID < 0 || flockID >= MAX_FLOCKS){
+        return JIT_ERR_NONE;
+    }
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->flockScale[flockID] = jit_atom_getfloat(argv);
+    flockPtr->outputLayout++; //the render mirror has the old scale
+    systhread_mutex_unlock(flockPtr->simLock);
+    
     return JIT_ERR_NONE;
 }
 
-t_jit_err jit_boids3d_maxspeed(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+
+/*!
+ @brief Sets the size of the density grid of the 10th outlet
+ @param argv voxels along each axis, 0 turns the grid off
+ @discussion The grid holds zeros until the next step splats the boids at the new size
+ */
+t_jit_err jit_boids3d_density(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
-    int flockID = (int)jit_atom_getfloat(argv+1);
-    flockPtr->maxspeed[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    TraceRecord(flockPtr, "density", 'i');
+    long size = CLAMP(jit_atom_getlong(argv), 0, kMaxDensitySize);
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    
+    //the grids take over 1 MB, so they wait until the grid is first used
+    if(size > 0 && !flockPtr->density){
+        flockPtr->density = (float *)calloc(kMaxDensityVoxels, sizeof(float));
+        flockPtr->densityPartials = calloc(kDensityPartials, sizeof(flockPtr->densityPartials[0]));
+        if(!flockPtr->density || !flockPtr->densityPartials){
+            post("ERROR: failed to allocate the density grid");
+            free(flockPtr->density);
+            free(flockPtr->densityPartials);
+            flockPtr->density = NULL;
+            flockPtr->densityPartials = NULL;
+            size = 0;
+        }
+    }
+    
+    flockPtr->densitySize = size;
+    if(flockPtr->density){
+        memset(flockPtr->density, 0, kMaxDensityVoxels*sizeof(float));
+    }
+    systhread_mutex_unlock(flockPtr->simLock);
+    
     return JIT_ERR_NONE;
 }
 
-t_jit_err jit_boids3d_center(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+
+/*!
+ @brief Sets how many positions each boid remembers for the 11th outlet
+ @param argv positions per boid, 0 turns the trails off
+ @discussion The trails start over, each from the position of its boid at the next step
+ */
+t_jit_err jit_boids3d_trail(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
-    int flockID = (int)jit_atom_getfloat(argv+1);
-    flockPtr->center[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    TraceRecord(flockPtr, "trail", 'i');
+    long length = CLAMP(jit_atom_getlong(argv), 0, kMaxTrailLength);
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    
+    //the ring buffers only exist while the trails are on, at their length
+    if(length != flockPtr->trailLength){
+        free(flockPtr->trails);
+        flockPtr->trails = NULL;
+        if(length > 0){
+            flockPtr->trails = (float *)malloc(kMaxNumBoids*length*3*sizeof(float));
+            if(!flockPtr->trails){
+                post("ERROR: failed to allocate the trails");
+                length = 0;
+            }
+        }
+    }
+    
+    flockPtr->trailLength = length;
+    flockPtr->trailHead = 0;
+    for(int i=0; i<MAX_FLOCKS; i++){
+        for(BoidPtr iterator = flockPtr->flockLL[i]; iterator; iterator = iterator->nextBoid){
+            iterator->trailFilled = 0;
+        }
+    }
+    systhread_mutex_unlock(flockPtr->simLock);
+    
     return JIT_ERR_NONE;
 }
 
-t_jit_err jit_boids3d_attract(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+
+/*!
+ @brief Asks for the boids within a radius of a point, for the 12th outlet
+ @param argv x, y, z, radius
+ @discussion Answered by the next output, from the positions and rows of its 1st outlet
+ */
+t_jit_err jit_boids3d_query_radius(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
-    int flockID = (int)jit_atom_getfloat(argv+1);
-    flockPtr->attract[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    TraceRecord(flockPtr, "query_radius", 'i');
+    if(argc < 4){
+        return JIT_ERR_NONE;
+    }
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    for(int i=0; i<4; i++){
+        flockPtr->queryArgs[i] = jit_atom_getfloat(argv+i);
+    }
+    flockPtr->queryArgCount = 4;
+    flockPtr->queryKind = kQueryRadius;
+    systhread_mutex_unlock(flockPtr->simLock);
+    
     return JIT_ERR_NONE;
 }
 
-t_jit_err jit_boids3d_match(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
-{
-    int flockID = (int)jit_atom_getfloat(argv+1);
+
+/*!
+ @brief Asks for the k boids nearest to a point, for the 12th outlet
+ @param argv x, y, z, k
+ @discussion Answered by the next output, from the positions and rows of its 1st outlet
+ */
+t_jit_err jit_boids3d_query_knn(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "query_knn", 'i');
+    if(argc < 4){
+        return JIT_ERR_NONE;
+    }
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    for(int i=0; i<4; i++){
+        flockPtr->queryArgs[i] = jit_atom_getfloat(argv+i);
+    }
+    flockPtr->queryArgCount = 4;
+    flockPtr->queryKind = kQueryKNN;
+    systhread_mutex_unlock(flockPtr->simLock);
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Orders rows of query results by distance, for qsort
+ */
+int CompareQueryRows(const void *a, const void *b)
+{
+    float distA = ((const float *)a)[2];
+    float distB = ((const float *)b)[2];
+    return (distA > distB) - (distA < distB);
+}
+
+
+/*!
+ @brief Sets how the boids of one flock see the boids of another, or of their own
+ @param argv flock of the boid, flock of the neighbor, sees (1, 0, or -1 to follow diffFlock),
+             cohesion, alignment and separation weight of such a neighbor
+ */
+t_jit_err jit_boids3d_interaction(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "interaction", 'i');
+    if(argc < 6){
+        return JIT_ERR_NONE;
+    }
+    
+    int observer = (int)jit_atom_getfloat(argv);
+    int seen = (int)jit_atom_getfloat(argv+1);
+    if(observer < 0 || observer >= MAX_FLOCKS || seen < 0 || seen >= MAX_FLOCKS){
+        return JIT_ERR_NONE;
+    }
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->flockSees[observer][seen] = (char)CLAMP((long)jit_atom_getfloat(argv+2), -1, 1);
+    for(int i=0; i<3; i++){
+        flockPtr->flockWeights[observer][seen][i] = jit_atom_getfloat(argv+3+i);
+    }
+    systhread_mutex_unlock(flockPtr->simLock);
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Turns per-phase frame timing on or off
+ @param argv boolean int of whether the phases of each frame should be timed
+ @discussion Turning it on clears the rolling statistics
+ */
+t_jit_err jit_boids3d_profile(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->profiling = (char)(jit_atom_getlong(argv) != 0);
+    
+    flockPtr->profileFrames = 0;
+    for(int i=0; i<kNumProfilePhases; i++){
+        flockPtr->phaseTime[i] = 0.0;
+    }
+    systhread_mutex_unlock(flockPtr->simLock);
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Sets the time budget of a simulation step
+ @param argv [0] = budget in ms, 0 turns the adaptive mode off
+ @discussion Restarts at full quality (level 0)
+ */
+t_jit_err jit_boids3d_budget(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "budget", 'i');
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->budget = MAX(jit_atom_getfloat(argv), 0.0);
+    flockPtr->budgetLevel = 0;
+    flockPtr->budgetSmoothed = 0.0;
+    flockPtr->budgetFramesAtLevel = 0;
+    systhread_mutex_unlock(flockPtr->simLock);
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Moves the simulation onto its own thread, or back onto the output
+ @param argv boolean int of whether the simulation should step asynchronously
+ @discussion While async, the thread steps at simrate and matrix_calc outputs the last finished frame without waiting for a step
+ */
+t_jit_err jit_boids3d_async(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "async", 'i');
+    
+    if(jit_atom_getlong(argv) != 0){
+        SimStart(flockPtr);
+        flockPtr->async = (flockPtr->simThread != NULL);
+    }else{
+        flockPtr->async = 0;
+        SimStop(flockPtr);
+    }
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Sets how many steps per second the simulation thread, or the fixed timestep, takes
+ @param argv [0] = steps per second
+ */
+t_jit_err jit_boids3d_simrate(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "simrate", 'i');
+    flockPtr->simRate = MIN(MAX(jit_atom_getfloat(argv), kMinSimRate), kMaxSimRate);
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Decouples the simulation rate from the output rate
+ @param argv boolean int of whether the output steps the simulation at simrate
+ @discussion Each output takes as many steps as the time since the last output holds (at most kMaxCatchUpSteps)
+             and outputs positions interpolated between the last two steps, which lags the simulation by up to one step
+ */
+t_jit_err jit_boids3d_fixedstep(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "fixedstep", 'i');
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->fixedStep = (char)(jit_atom_getlong(argv) != 0);
+    flockPtr->stepAccumulator = 0.0;
+    flockPtr->lastOutputTime = 0.0;
+    flockPtr->stepAlpha = 1.0;
+    systhread_mutex_unlock(flockPtr->simLock);
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Runs a number of steps in a tight loop, without building the output matrices
+ @param argv [0] = number of steps
+ @discussion Blocks until the steps are done; use warmup to run them in the background
+ */
+t_jit_err jit_boids3d_step(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "step", 'B');
+    flockPtr->fastForward = MAX(jit_atom_getlong(argv), 0);
+    FastForward(flockPtr, flockPtr->fastForward, NULL);
+    TraceRecord(flockPtr, "step", 'E');
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Runs a number of steps on a background thread, so a scene can open already settled
+ @param argv [0] = number of steps, 0 stops a warm-up that is running
+ @discussion Send it once the flocks are set up. The outputs are left untouched until the warm-up is done.
+ */
+t_jit_err jit_boids3d_warmup(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "warmup", 'i');
+    WarmupStop(flockPtr);
+    
+    flockPtr->warmupSteps = MAX(jit_atom_getlong(argv), 0);
+    if(flockPtr->warmupSteps == 0){
+        return JIT_ERR_NONE;
+    }
+    
+    flockPtr->warmupQuit = 0;
+    flockPtr->warming = 1;
+    if(systhread_create((method)WarmupThreadProc, flockPtr, 0, 0, 0, &flockPtr->warmupThread) != 0){
+        post("ERROR: failed to start the warm-up thread");
+        flockPtr->warmupThread = NULL;
+        flockPtr->warming = 0;
+    }
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+ @brief Starts recording a Chrome trace, or stops and writes the current one
+ @param argv [0] = file the trace is written to. No argument stops the trace.
+ @discussion The trace is written as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) when it stops,
+             when a new trace is started, or when the object is freed
+ */
+t_jit_err jit_boids3d_trace(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    t_symbol *file = (argc > 0) ? jit_atom_getsym(argv) : _jit_sym_nothing;
+    
+    //close the trace that is already open
+    systhread_mutex_lock(flockPtr->simLock);
+    TraceStop(flockPtr);
+    
+    if(file && file != _jit_sym_nothing){
+        TraceStart(flockPtr, file);
+    }
+    systhread_mutex_unlock(flockPtr->simLock);
+    
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+    @brief Deletes an attractor with given ID
+    @param argv the ID of the attractor to be deleted
+ */
+t_jit_err jit_boids3d_deleteattractor(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "deleteattractor", 'B');
+    systhread_mutex_lock(flockPtr->simLock);
+    int attractorID = (int)jit_atom_getlong(argv);
+    AttractorPtr iterator = flockPtr->attractorLL;
+    AttractorPtr prev = iterator;
+    
+    //iterate thru the LL of attractors to find the right one
+    while(iterator){
+        if(iterator->id == attractorID){
+            //this is the attractor to delete
+            if(prev == iterator){ //first attractor
+                iterator = iterator->nextAttractor;
+                free(prev);
+                flockPtr->attractorLL = iterator;
+                
+            }else{
+                
+                //middle or end
+                prev->nextAttractor = iterator->nextAttractor;
+                free(iterator);
+            }
+            
+            //update numAttractors and mark the LL NULL if necessary
+            flockPtr->numAttractors--;
+            flockPtr->attractorsVersion++;
+            if(flockPtr->numAttractors <= 0){
+                flockPtr->attractorLL = NULL;
+            }
+            systhread_mutex_unlock(flockPtr->simLock);
+            TraceRecord(flockPtr, "deleteattractor", 'E');
+            return JIT_ERR_NONE;
+            
+        }
+        prev = iterator;
+        iterator = iterator->nextAttractor;
+    }
+    
+    //couldn't find this attractor
+    systhread_mutex_unlock(flockPtr->simLock);
+    TraceRecord(flockPtr, "deleteattractor", 'E');
+    return JIT_ERR_NONE;
+}
+
+
+/*
+ Following methods update flock-specific attributes
+ */
+
+//---NOT CURRENTLY USED---
+t_jit_err jit_boids3d_neighbors(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->neighbors = (double)MIN(jit_atom_getfloat(argv), kMaxNeighbors);
+    systhread_mutex_unlock(flockPtr->simLock);
+    return JIT_ERR_NONE;
+}
+//--------------------------
+
+t_jit_err jit_boids3d_nradius(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "nradius", 'i');
+    int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->neighborRadius[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.0);
+    systhread_mutex_unlock(flockPtr->simLock);
+    return JIT_ERR_NONE;
+}
+
+t_jit_err jit_boids3d_minspeed(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "minspeed", 'i');
+    int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->minspeed[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
+    return JIT_ERR_NONE;
+}
+
+t_jit_err jit_boids3d_maxspeed(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "maxspeed", 'i');
+    int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->maxspeed[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
+    return JIT_ERR_NONE;
+}
+
+t_jit_err jit_boids3d_center(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "center", 'i');
+    int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->center[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
+    return JIT_ERR_NONE;
+}
+
+t_jit_err jit_boids3d_attract(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "attract", 'i');
+    int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->attract[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
+    return JIT_ERR_NONE;
+}
+
+t_jit_err jit_boids3d_match(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "match", 'i');
+    int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
     flockPtr->match[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
     return JIT_ERR_NONE;
 }
 
 t_jit_err jit_boids3d_sepwt(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "sepwt", 'i');
     int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
     flockPtr->sepwt[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
     return JIT_ERR_NONE;
 }
 
 t_jit_err jit_boids3d_sepdist(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "sepdist", 'i');
     int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
     flockPtr->sepdist[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
     return JIT_ERR_NONE;
 }
 
 t_jit_err jit_boids3d_speed(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "speed", 'i');
     int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
     flockPtr->speed[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
     return JIT_ERR_NONE;
 }
 
 t_jit_err jit_boids3d_inertia(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "inertia", 'i');
     double val = (double)jit_atom_getfloat(argv);
     int flockID =(int)jit_atom_getfloat(argv+1);
     
+    systhread_mutex_lock(flockPtr->simLock);
     if(val == 0.0)
         flockPtr->inertia[flockID] = 0.000001;
     else
         flockPtr->inertia[flockID] = val;
+    systhread_mutex_unlock(flockPtr->simLock);
     return JIT_ERR_NONE;
 }
 
 t_jit_err jit_boids3d_accel(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "accel", 'i');
     int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
     flockPtr->accel[flockID] = (double)MAX(jit_atom_getfloat(argv), 0.000001);
+    systhread_mutex_unlock(flockPtr->simLock);
     return JIT_ERR_NONE;
 }
 
 t_jit_err jit_boids3d_age(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "age", 'i');
     int flockID = (int)jit_atom_getfloat(argv+1);
+    systhread_mutex_lock(flockPtr->simLock);
     flockPtr->age[flockID] = (double)jit_atom_getfloat(argv);
+    systhread_mutex_unlock(flockPtr->simLock);
     return JIT_ERR_NONE;
 }
 
@@ -658,9 +1846,12 @@ t_jit_err jit_boids3d_age(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom
  */
 t_jit_err jit_boids3d_birthloc(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv){
     
+    TraceRecord(flockPtr, "birthloc", 'i');
+    systhread_mutex_lock(flockPtr->simLock);
     flockPtr->birthLoc[x] = (double)jit_atom_getfloat(argv);
     flockPtr->birthLoc[y] = (double)jit_atom_getfloat(argv+1);
     flockPtr->birthLoc[z] = (double)jit_atom_getfloat(argv+2);
+    systhread_mutex_unlock(flockPtr->simLock);
     
     return JIT_ERR_NONE;
 }
@@ -673,6 +1864,8 @@ t_jit_err jit_boids3d_birthloc(t_jit_boids3d *flockPtr, void *attr, long argc, t
  */
 t_jit_err jit_boids3d_number(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
 {
+    TraceRecord(flockPtr, "number", 'B');
+    systhread_mutex_lock(flockPtr->simLock);
     int boidChanges[MAX_FLOCKS]; //number of boids being deleted from each flock
     
     int newNumBoids; //new total number of boids across all flocks
@@ -692,9 +1885,14 @@ t_jit_err jit_boids3d_number(t_jit_boids3d *flockPtr, void *attr, long argc, t_a
         }
     }
     if(changed == 0 || totalChanges+CalcNumBoids(flockPtr)>kMaxNumBoids){
+        systhread_mutex_unlock(flockPtr->simLock);
+        TraceRecord(flockPtr, "number", 'E');
         return NULL;
     }
     
+    //the render mirror no longer lists the same boids
+    flockPtr->mirrorPlanecount = 0;
+    
     //iterate thru flocks and update boids
     for (int i=0; i<MAX_FLOCKS; i++){
         
@@ -708,10 +1906,12 @@ t_jit_err jit_boids3d_number(t_jit_boids3d *flockPtr, void *attr, long argc, t_a
                     break;
                 }
                 iterator = iterator->nextBoid;
+                TrailRelease(flockPtr, toBeDeleted);
                 free(toBeDeleted);
                 toBeDeleted = iterator;
                 flockPtr->flockLL[i] = iterator;
                 flockPtr->boidCount[i]--; //update the number of boids in flock
+                flockPtr->countsVersion++;
                 boidChanges[i]++;
             }
         }else{ //we're adding boids
@@ -720,6 +1920,8 @@ t_jit_err jit_boids3d_number(t_jit_boids3d *flockPtr, void *attr, long argc, t_a
                 //initialize a new boid and add it to the front of the LL
                 BoidPtr newBoid = InitBoid(flockPtr);
                 if(!newBoid){
+                    systhread_mutex_unlock(flockPtr->simLock);
+                    TraceRecord(flockPtr, "number", 'E');
                     return NULL;
                 }
                 newBoid->nextBoid = flockPtr->flockLL[i];
@@ -727,10 +1929,14 @@ t_jit_err jit_boids3d_number(t_jit_boids3d *flockPtr, void *attr, long argc, t_a
                 newBoid->flockID = i;
                 
                 flockPtr->boidCount[i]++; //update the number of boids in flock
+                flockPtr->countsVersion++;
             }
         }
     }
     
+    systhread_mutex_unlock(flockPtr->simLock);
+    TraceRecord(flockPtr, "number", 'E');
+    
     return 0;
 }
 
@@ -771,10 +1977,85 @@ t_jit_err jit_boids3d_stats(t_jit_boids3d *flockPtr, void *attr, long argc, t_at
     //neighbor connections
     post("Number of Neighbor Lines: %d/%d", flockPtr->sizeOfNeighborhoodConnections, kMaxNeighborLines);
     
+    //frame budget
+    if(flockPtr->budget > 0){
+        post("Frame Budget: %0.2f ms, step %0.2f ms, level %d/%d", flockPtr->budget, flockPtr->budgetSmoothed, flockPtr->budgetLevel, kNumBudgetLevels-1);
+    }
+    
     post("Largest boid ID: %d", flockPtr->newBoidID);
     
+    //frame timing
+    if(flockPtr->profiling && flockPtr->profileFrames > 0){
+        post("Frame Timing (ms, mean/p95/p99 over %d frames):", MIN(flockPtr->profileFrames, kProfileWindow));
+        for(int i=0; i<kNumProfilePhases; i++){
+            double mean, p95, p99;
+            ProfileSummary(flockPtr, i, &mean, &p95, &p99);
+            post("   %s: %0.3f / %0.3f / %0.3f", kProfilePhaseNames[i], mean, p95, p99);
+        }
+    }
+    
+    post("- - - - - - -");
+    
+    return 0;
+}
+
+
+/*!
+    @brief Posts how much precision the fields of the 1st outlet lose as float16, for the current state
+    @discussion For each field: the largest absolute and relative error and the largest magnitude,
+                which decides the spacing of float16 values (about a thousandth of it)
+ */
+t_jit_err jit_boids3d_halfreport(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv){
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    
+    long planecount = OutputPlanecount(flockPtr);
+    float *values = (float *)malloc(MAX(CalcNumBoids(flockPtr), 1)*MAX(planecount, 1)*sizeof(float));
+    if(!values){
+        systhread_mutex_unlock(flockPtr->simLock);
+        return JIT_ERR_OUT_OF_MEM;
+    }
+    
+    //the fields of every boid, as the 1st outlet would output them in float32
+    long numBoids = 0;
+    for(int i=0; i<MAX_FLOCKS; i++){
+        BoidPtr iterator = flockPtr->flockLL[i];
+        while(iterator){
+            PackBoid(flockPtr, iterator, 1.0, values + numBoids*planecount);
+            numBoids++;
+            iterator = iterator->nextBoid;
+        }
+    }
+    
+    post(" - - FLOAT16 ACCURACY (%d boids) - - ", numBoids);
+    
+    long plane = 0;
+    for(int i=0; i<flockPtr->numOutputFields; i++){
+        int field = flockPtr->outputFields[i];
+        double maxError = 0, maxRelative = 0, largest = 0;
+        
+        for(long b=0; b<numBoids; b++){
+            for(int p=0; p<kOutputFieldPlanes[field]; p++){
+                float value = values[b*planecount + plane + p];
+                double error = fabs(jit_half_to_float(FloatToHalf(value)) - value);
+                
+                maxError = MAX(maxError, error);
+                largest = MAX(largest, fabs(value));
+                if(value != 0){
+                    maxRelative = MAX(maxRelative, error/fabs(value));
+                }
+            }
+        }
+        
+        post("   %s: max error %0.6f, max relative error %0.6f, largest value %0.3f%s", kOutputFieldNames[field],
+             maxError, maxRelative, largest, (largest > JIT_HALF_MAX) ? " (out of range)" : "");
+        plane += kOutputFieldPlanes[field];
+    }
+    
     post("- - - - - - -");
     
+    free(values);
+    systhread_mutex_unlock(flockPtr->simLock);
     return 0;
 }
 
@@ -790,247 +2071,794 @@ t_jit_err jit_boids3d_stats(t_jit_boids3d *flockPtr, void *attr, long argc, t_at
  */
 t_jit_err jit_boids3d_matrix_calc(t_jit_boids3d *flockPtr, void *inputs, void *outputs)
 {
+    //a warm-up is stepping in the background, keep showing the last output
+    if(flockPtr->warming){
+        return JIT_ERR_NONE;
+    }
+    
+    double frameStart = ProfileBegin(flockPtr);
+    TraceRecord(flockPtr, "matrix_calc", 'B');
     
-    //do a step in the simulation
-    FlightStep(flockPtr);
+    //do a step in the simulation, or take the last one the simulation thread finished
+    SimFramePtr frame = NULL;
+    if(flockPtr->async){
+        frame = SimAcquire(flockPtr);
+    }else{
+        int steps = 1;
+        flockPtr->stepAlpha = 1.0;
+        if(flockPtr->fixedStep){
+            steps = FixedStepCount(flockPtr); //also sets stepAlpha
+        }
+        
+        TraceRecord(flockPtr, "FlightStep", 'B');
+        systhread_mutex_lock(flockPtr->simLock);
+        for(int i=0; i<steps; i++){
+            FlightStep(flockPtr, 1);
+        }
+        systhread_mutex_unlock(flockPtr->simLock);
+        TraceRecord(flockPtr, "FlightStep", 'E');
+    }
     
     t_jit_err err=JIT_ERR_NONE;
-    long out_savelock, out2_savelock, out3_savelock, out4_savelock; //if there is a problem, saves and locks the output matricies
-    t_jit_matrix_info out_minfo, out2_minfo, out3_minfo, out4_minfo;
-    char *out_bp, *out2_bp, *out3_bp, *out4_bp;
+    long out_savelock, out2_savelock, out3_savelock, out4_savelock, out5_savelock, out6_savelock, out7_savelock, out8_savelock, out9_savelock, out10_savelock, out11_savelock, out12_savelock; //if there is a problem, saves and locks the output matricies
+    t_jit_matrix_info out_minfo, out2_minfo, out3_minfo, out4_minfo, out5_minfo, out6_minfo, out7_minfo, out8_minfo, out9_minfo, out10_minfo, out11_minfo, out12_minfo;
+    char *out_bp, *out2_bp, *out3_bp, *out4_bp, *out5_bp, *out6_bp, *out7_bp, *out8_bp, *out9_bp, *out10_bp, *out11_bp, *out12_bp;
     long i,dimcount,planecount,dim[JIT_MATRIX_MAX_DIMCOUNT]; //dimensions and planes for the first output matrix
-    void *out_matrix, *out2_matrix, *out3_matrix, *out4_matrix;
+    void *out_matrix, *out2_matrix, *out3_matrix, *out4_matrix, *out5_matrix, *out6_matrix, *out7_matrix, *out8_matrix, *out9_matrix, *out10_matrix, *out11_matrix, *out12_matrix;
     
     out_matrix = jit_object_method(outputs,_jit_sym_getindex,0);
     out2_matrix = jit_object_method(outputs,_jit_sym_getindex,1);
     out3_matrix     = jit_object_method(outputs, _jit_sym_getindex, 2);
     out4_matrix     = jit_object_method(outputs, _jit_sym_getindex, 3);
-    
-    if (flockPtr&&out_matrix&&out2_matrix&&out3_matrix&&out4_matrix) {
+    out5_matrix     = jit_object_method(outputs, _jit_sym_getindex, 4);
+    out6_matrix     = jit_object_method(outputs, _jit_sym_getindex, 5);
+    out7_matrix     = jit_object_method(outputs, _jit_sym_getindex, 6);
+    out8_matrix     = jit_object_method(outputs, _jit_sym_getindex, 7);
+    out9_matrix     = jit_object_method(outputs, _jit_sym_getindex, 8);
+    out10_matrix    = jit_object_method(outputs, _jit_sym_getindex, 9);
+    out11_matrix    = jit_object_method(outputs, _jit_sym_getindex, 10);
+    out12_matrix    = jit_object_method(outputs, _jit_sym_getindex, 11);
+    
+    if (flockPtr&&out_matrix&&out2_matrix&&out3_matrix&&out4_matrix&&out5_matrix&&out6_matrix&&out7_matrix&&out8_matrix&&out9_matrix&&out10_matrix&&out11_matrix&&out12_matrix) {
+        double packingStart = ProfileBegin(flockPtr);
+        TraceRecord(flockPtr, "packing", 'B');
+        
         out_savelock = (long) jit_object_method(out_matrix,_jit_sym_lock,1);
         out2_savelock = (long) jit_object_method(out2_matrix,_jit_sym_lock,1);
         out3_savelock = (long) jit_object_method(out3_matrix, _jit_sym_lock,1);
         out4_savelock = (long) jit_object_method(out4_matrix, _jit_sym_lock,1);
+        out5_savelock = (long) jit_object_method(out5_matrix, _jit_sym_lock,1);
+        out6_savelock = (long) jit_object_method(out6_matrix, _jit_sym_lock,1);
+        out7_savelock = (long) jit_object_method(out7_matrix, _jit_sym_lock,1);
+        out8_savelock = (long) jit_object_method(out8_matrix, _jit_sym_lock,1);
+        out9_savelock = (long) jit_object_method(out9_matrix, _jit_sym_lock,1);
+        out10_savelock = (long) jit_object_method(out10_matrix, _jit_sym_lock,1);
+        out11_savelock = (long) jit_object_method(out11_matrix, _jit_sym_lock,1);
+        out12_savelock = (long) jit_object_method(out12_matrix, _jit_sym_lock,1);
+        
+        void *outMatrices[kNumOutlets] = {out_matrix, out2_matrix, out3_matrix, out4_matrix, out5_matrix, out6_matrix,
+                                          out7_matrix, out8_matrix, out9_matrix, out10_matrix, out11_matrix, out12_matrix};
+        t_jit_matrix_info *outInfos[kNumOutlets] = {&out_minfo, &out2_minfo, &out3_minfo, &out4_minfo, &out5_minfo, &out6_minfo,
+                                                    &out7_minfo, &out8_minfo, &out9_minfo, &out10_minfo, &out11_minfo, &out12_minfo};
+        char **outData[kNumOutlets] = {&out_bp, &out2_bp, &out3_bp, &out4_bp, &out5_bp, &out6_bp,
+                                       &out7_bp, &out8_bp, &out9_bp, &out10_bp, &out11_bp, &out12_bp};
+        
+        //assign the out_infos to their cooresponding out matrix
+        for(int i=0; i<kNumOutlets; i++){
+            OutputMatrixGetInfo(flockPtr, i, outMatrices[i], outInfos[i], outData[i]);
+        }
         
-        jit_object_method(out_matrix,_jit_sym_getinfo,&out_minfo); //assign the out_infos to their cooresponding out matrix
-        jit_object_method(out2_matrix,_jit_sym_getinfo,&out2_minfo);
-        jit_object_method(out3_matrix,_jit_sym_getinfo, &out3_minfo);
-        jit_object_method(out4_matrix,_jit_sym_getinfo, &out4_minfo);
+        int numBoids = frame ? frame->numBoids : PackOrder(flockPtr); //also the rows of the neighbor lines
+        long numLines = frame ? frame->numLines : flockPtr->sizeOfNeighborhoodConnections;
         
-        int numBoids = CalcNumBoids(flockPtr);
+        //output the selected fields
+        long outPlanecount = frame ? frame->planecount : OutputPlanecount(flockPtr); //the fields the frame was packed with
         
+        //float16 goes out as 2 char planes per plane
+        char halfOutput = flockPtr->halfOutput;
+        t_symbol *outType = _jit_sym_float32; //outputting floating point numbers
+        if(halfOutput){
+            outType = _jit_sym_char;
+            outPlanecount *= 2;
+        }
+        
+        //resize the matrices whose dimensions changed, a resized matrix has to be rewritten
         //dimensions of the output matrix (number of boids x 1)
-        out_minfo.dim[0] = numBoids;
-        out_minfo.dim[1] = 1;
-        out_minfo.type = _jit_sym_float32; //outputting floating point numbers
+        OutputMatrixInfo(out_matrix, &out_minfo, numBoids, 1, outType, outPlanecount);
         
         //(number of flocks x 1)
-        out2_minfo.dim[0] = MAX_FLOCKS;
-        out2_minfo.dim[1] = 1;
-        out2_minfo.type = _jit_sym_float32; //outputting floating point numbers
-        out2_minfo.planecount = 1;
+        char countsDirty = OutputMatrixInfo(out2_matrix, &out2_minfo, MAX_FLOCKS, 1, _jit_sym_float32, 1);
         
         //dimensions of attractor output matrix (number of attractors x 1)
-        out3_minfo.dim[0] = flockPtr->numAttractors;
-        out3_minfo.dim[1] = 1;
-        out3_minfo.type = _jit_sym_float32; //outputting floating point numbers
-        out3_minfo.planecount = 5; //xyz, id, attractorRadius
-        
-        //dimensions of the neighborhood line connecting matrix
-        out4_minfo.dim[0] = flockPtr->sizeOfNeighborhoodConnections;
-        out4_minfo.dim[1] = 1;
-        out4_minfo.type = _jit_sym_float32;
-        out4_minfo.planecount = 9;
-        
-        //output the correct mode
-        switch(flockPtr->mode) { // newpos
-            case 0:
-                out_minfo.planecount = 4;
-                break;
-            case 1: //newpos + oldpos
-                out_minfo.planecount = 7;
-                break;
-            case 2://newpos +  oldpos + speed-azimuth-elevation
-                out_minfo.planecount = 10;
-                break;
+        char attractorStatsOn = flockPtr->attractorStatsOn;
+        long attractorPlanecount = 5 + (attractorStatsOn ? kAttractorStatsPlanes : 0); //xyz, id, attractorRadius, statistics
+        char attractorsDirty = OutputMatrixInfo(out3_matrix, &out3_minfo, flockPtr->numAttractors, 1, _jit_sym_float32, attractorPlanecount);
+        
+        //dimensions of the neighborhood line connecting matrix, as endpoints or as rows of the 1st outlet
+        char lineOutput = flockPtr->lineOutput;
+        long numIndexedLines = 0;
+        for(int i=0; lineOutput && i<numLines; i++){
+            NeighborLinePtr line = frame ? &frame->lines[i] : flockPtr->neighborhoodConnections[i];
+            numIndexedLines += line->index[0] >= 0 && line->index[1] >= 0;
+        }
+        if(lineOutput == 1){
+            OutputMatrixInfo(out4_matrix, &out4_minfo, numIndexedLines, 1, _jit_sym_long, 2); //indexA, indexB
+        }else if(lineOutput){
+            OutputMatrixInfo(out4_matrix, &out4_minfo, numIndexedLines, 1, _jit_sym_float32, 3); //indexA, indexB, weight
+        }else{
+            OutputMatrixInfo(out4_matrix, &out4_minfo, numLines, 1, _jit_sym_float32, 9);
         }
         
-        //for some reason, 2 of these in a row are required
-        jit_object_method(out_matrix,_jit_sym_setinfo,&out_minfo);
-        jit_object_method(out_matrix,_jit_sym_getinfo,&out_minfo);
+        //dimensions of the frame timing matrix (number of phases x 1)
+        OutputMatrixInfo(out5_matrix, &out5_minfo, kNumProfilePhases, 1, _jit_sym_float32, 4); //last, mean, p95, p99
+        
+        //dimensions of the histogram matrix (bins x number of flocks)
+        OutputMatrixInfo(out6_matrix, &out6_minfo, kHistogramBins, MAX_FLOCKS, _jit_sym_float32, 2); //neighbors found, candidates tested
+        
+        //dimensions of the flock index matrix (number of flocks x 1)
+        OutputMatrixInfo(out7_matrix, &out7_minfo, MAX_FLOCKS, 1, _jit_sym_float32, 2); //offset, count
+        
+        //dimensions of the flock statistics matrix (number of flocks x 1)
+        OutputMatrixInfo(out8_matrix, &out8_minfo, MAX_FLOCKS, 1, _jit_sym_float32, kFlockStatsPlanes);
+        
+        //dimensions of the cluster summary matrix (number of clusters x 1)
+        long numClusters = flockPtr->clustering ? (frame ? frame->numClusters : flockPtr->numClusters) : 0;
+        OutputMatrixInfo(out9_matrix, &out9_minfo, numClusters > 0 ? numClusters : 1, 1, _jit_sym_float32, kClusterPlanes);
         
-        jit_object_method(out2_matrix,_jit_sym_setinfo,&out2_minfo);
-        jit_object_method(out2_matrix,_jit_sym_getinfo,&out2_minfo);
+        //dimensions of the density grid (size x size x size), OutputMatrixInfo compares only the first 2
+        long densitySize = frame ? frame->densitySize : flockPtr->densitySize;
+        if(out10_minfo.dimcount != 3 || out10_minfo.dim[2] != MAX(densitySize, 1)){
+            out10_minfo.dimcount = 3;
+            out10_minfo.dim[2] = MAX(densitySize, 1);
+            out10_minfo.planecount = 0; //forces the resize
+        }
+        OutputMatrixInfo(out10_matrix, &out10_minfo, densitySize, densitySize, _jit_sym_float32, 1);
+        
+        //dimensions of the trail matrix (rows of the 1st outlet x trail length)
+        long trailLength = frame ? frame->trailLength : flockPtr->trailLength;
+        long trailBoids = frame ? frame->trailBoids : numBoids;
+        OutputMatrixInfo(out11_matrix, &out11_minfo, trailBoids, trailLength, _jit_sym_float32, 3);
         
-        jit_object_method(out3_matrix,_jit_sym_setinfo,&out3_minfo);
-        jit_object_method(out3_matrix,_jit_sym_getinfo,&out3_minfo);
+        //dimensions of the query result matrix (boids found x 1)
+        long queryCount = frame ? frame->queryCount : flockPtr->queryCount;
+        long queryVersion = frame ? frame->queryVersion : flockPtr->queryVersion;
+        char queryDirty = OutputMatrixInfo(out12_matrix, &out12_minfo, queryCount, 1, _jit_sym_float32, 3); //index, globalID, distance
         
-        jit_object_method(out4_matrix,_jit_sym_setinfo,&out4_minfo);
-        jit_object_method(out4_matrix,_jit_sym_getinfo,&out4_minfo);
+        //the side outlets still hold the last version unless it changed
+        long countsVersion = frame ? frame->countsVersion : flockPtr->countsVersion;
+        countsDirty |= countsVersion != flockPtr->outputCountsVersion;
+        attractorsDirty |= flockPtr->attractorsVersion != flockPtr->outputAttractorsVersion;
+        attractorsDirty |= attractorStatsOn; //change every step
+        queryDirty |= queryVersion != flockPtr->outputQueryVersion;
         
-        jit_object_method(out_matrix,_jit_sym_getdata,&out_bp);
-        jit_object_method(out2_matrix,_jit_sym_getdata,&out2_bp);
-        jit_object_method(out3_matrix,_jit_sym_getdata,&out3_bp);
-        jit_object_method(out4_matrix,_jit_sym_getdata,&out4_bp);
+        for(int i=0; i<kNumOutlets; i++){
+            OutputMatrixGetData(flockPtr, i, outMatrices[i], outInfos[i], outData[i]);
+        }
         
         //something went wrong, handle the error
-        if (!out_bp || !out2_bp || !out3_bp || !out4_bp) {
+        if (!out_bp || !out2_bp || !out3_bp || !out4_bp || !out5_bp || !out6_bp || !out7_bp || !out8_bp || !out9_bp || !out10_bp || !out11_bp || !out12_bp) {
             err=JIT_ERR_INVALID_OUTPUT;
+            TraceRecord(flockPtr, "packing", 'E');
             goto out;
         }
         
-        //populate the second outlet matrix with data
-        float *out2_data = (float*)out2_bp;
+        if(countsDirty){
+            //populate the second outlet matrix with data
+            float *out2_data = (float*)out2_bp;
+            for(int i=0; i<MAX_FLOCKS; i++){
+                out2_data[0] = frame ? frame->boidCount[i] : flockPtr->boidCount[i];
+                out2_data+=1;
+            }
+            
+            flockPtr->outputCountsVersion = countsVersion;
+        }
+        
+        //populate the 7th outlet with the range of each flock in the 1st outlet, which changes with cull and depthsort
+        long (*flockRanges)[2] = frame ? frame->flockRanges : flockPtr->flockRanges;
+        float *out7_data = (float*)out7_bp;
         for(int i=0; i<MAX_FLOCKS; i++){
-            out2_data[0] = flockPtr->boidCount[i];
-            out2_data+=1;
+            out7_data[0] = flockRanges[i][0];
+            out7_data[1] = flockRanges[i][1];
+            out7_data+=2;
         }
         
-        //populate the 3rd outlet with data
-        float *out3_data = (float*)out3_bp;
-        AttractorPtr iterator = flockPtr->attractorLL;
-        while(iterator){
-            out3_data[0] = iterator->loc[0];
-            out3_data[1] = iterator->loc[1];
-            out3_data[2] = iterator->loc[2];
-            out3_data[3] = iterator->id;
-            out3_data[4] = iterator->attractorRadius;
+        if(attractorsDirty){
+            //populate the 3rd outlet with data
+            float *out3_data = (float*)out3_bp;
+            AttractorPtr iterator = flockPtr->attractorLL;
+            while(iterator){
+                out3_data[0] = iterator->loc[0];
+                out3_data[1] = iterator->loc[1];
+                out3_data[2] = iterator->loc[2];
+                out3_data[3] = iterator->id;
+                out3_data[4] = iterator->attractorRadius;
+                
+                //the statistics of the last finished step, or of the frame while the asynchronous simulation
+                //runs the next step and writes stats
+                if(attractorStatsOn){
+                    AttractorStats stats = frame ? iterator->frameStats[frame->index] : iterator->stats;
+                    for(int i=0; i<MAX_FLOCKS; i++){
+                        out3_data[5+i] = stats.count[i];
+                        out3_data[5+MAX_FLOCKS+i] = stats.count[i] > 0 ? stats.distSum[i] / stats.count[i] : 0.0;
+                    }
+                    out3_data[5+2*MAX_FLOCKS] = stats.nearestID;
+                    out3_data[6+2*MAX_FLOCKS] = stats.nearestID >= 0 ? stats.nearestDist : 0.0;
+                }
+                
+                out3_data += attractorPlanecount;
+                
+                iterator=iterator->nextAttractor;
+            }
             
-            out3_data += 5; //planecount
+            //without attractors the matrix keeps 1 row, which must not look like an attractor
+            if(flockPtr->numAttractors <= 0){
+                memset(out3_bp, 0, attractorPlanecount*sizeof(float));
+            }
             
-            iterator=iterator->nextAttractor;
+            flockPtr->outputAttractorsVersion = flockPtr->attractorsVersion;
         }
         
         //populate the 4th outlet with data
         float *out4_data = (float*)out4_bp;
+        t_int32 *out4_index = (t_int32*)out4_bp;
+        
+        for(int i=0; lineOutput && i<numLines; i++){
+            
+            NeighborLinePtr line = frame ? &frame->lines[i] : flockPtr->neighborhoodConnections[i];
+            if(line->index[0] < 0 || line->index[1] < 0){
+                continue;
+            }
+            
+            if(lineOutput == 1){
+                out4_index[0] = line->index[0];
+                out4_index[1] = line->index[1];
+                out4_index += 2; //planecount
+            }else{
+                //1 for boids on top of each other down to 0 at the neighbor radius, as the neighbor search found them;
+                //between 2 flocks the larger radius of the 2, which either end may have found the other with
+                float dx = line->boidB[x] - line->boidA[x];
+                float dy = line->boidB[y] - line->boidA[y];
+                float dz = line->boidB[z] - line->boidA[z];
+                double radius = MAX(flockPtr->neighborRadius[line->flockID[0]], flockPtr->neighborRadius[line->flockID[1]]);
+                double weight = radius > 0 ? 1.0 - jit_math_sqrt(dx*dx + dy*dy + dz*dz)/radius : 0.0;
+                
+                out4_data[0] = line->index[0];
+                out4_data[1] = line->index[1];
+                out4_data[2] = CLAMP(weight, 0.0, 1.0);
+                out4_data += 3; //planecount
+            }
+        }
+        
+        //without lines the matrix keeps 1 row, indices of -1 or a line of length 0
+        if(lineOutput == 1 && numIndexedLines <= 0){
+            out4_index[0] = out4_index[1] = -1;
+        }else if(lineOutput && numIndexedLines <= 0){
+            out4_data[0] = out4_data[1] = -1;
+            out4_data[2] = 0;
+        }else if(!lineOutput && numLines <= 0){
+            memset(out4_bp, 0, 9*sizeof(float));
+        }
         
-        for(int i=0; i<flockPtr->sizeOfNeighborhoodConnections; i++){
+        for(int i=0; !lineOutput && i<numLines; i++){
             
-            out4_data[0] = flockPtr->neighborhoodConnections[i]->boidA[x];
-            out4_data[1] = flockPtr->neighborhoodConnections[i]->boidA[y];
-            out4_data[2] = flockPtr->neighborhoodConnections[i]->boidA[z];
+            NeighborLinePtr line = frame ? &frame->lines[i] : flockPtr->neighborhoodConnections[i];
             
-            out4_data[3] = flockPtr->neighborhoodConnections[i]->boidB[x];
-            out4_data[4] = flockPtr->neighborhoodConnections[i]->boidB[y];
-            out4_data[5] = flockPtr->neighborhoodConnections[i]->boidB[z];
+            out4_data[0] = line->boidA[x];
+            out4_data[1] = line->boidA[y];
+            out4_data[2] = line->boidA[z];
             
-            out4_data[6] = flockPtr->neighborhoodConnections[i]->flockID[0];
-            out4_data[7] = flockPtr->neighborhoodConnections[i]->flockID[1];
+            out4_data[3] = line->boidB[x];
+            out4_data[4] = line->boidB[y];
+            out4_data[5] = line->boidB[z];
             
-            out4_data[8] = flockPtr->sizeOfNeighborhoodConnections; //TODO: this is a little hacky, should not need to dedicate a whole plane to this
+            out4_data[6] = line->flockID[0];
+            out4_data[7] = line->flockID[1];
+            
+            out4_data[8] = numLines; //TODO: this is a little hacky, should not need to dedicate a whole plane to this
             
             out4_data += 9; //planecount
         }
         
         
         
+        //populate the 6th outlet with the histograms, one row per flock
+        long (*neighborHistogram)[kHistogramBins] = frame ? frame->neighborHistogram : flockPtr->neighborHistogram;
+        long (*candidateHistogram)[kHistogramBins] = frame ? frame->candidateHistogram : flockPtr->candidateHistogram;
+        for(int i=0; i<MAX_FLOCKS; i++){
+            float *out6_data = (float*)(out6_bp + i*out6_minfo.dimstride[1]);
+            for(int j=0; j<kHistogramBins; j++){
+                out6_data[0] = flockPtr->histogramming ? neighborHistogram[i][j] : 0;
+                out6_data[1] = flockPtr->histogramming ? candidateHistogram[i][j] : 0;
+                
+                out6_data += 2; //planecount
+            }
+        }
+        
+        //populate the 8th outlet with the statistics of each flock
+        FlockStats *flockStats = frame ? frame->flockStats : flockPtr->flockStats;
+        for(int i=0; i<MAX_FLOCKS; i++){
+            float *out8_data = (float*)out8_bp + i*kFlockStatsPlanes;
+            if(flockPtr->flockStatsOn){
+                FlockStatsFill(&flockStats[i], out8_data);
+            }else{
+                memset(out8_data, 0, kFlockStatsPlanes*sizeof(float));
+            }
+        }
+        
+        //populate the 9th outlet with the clusters, a row of 0 when there are none
+        if(numClusters > 0){
+            memcpy(out9_bp, frame ? frame->clusterSummary : flockPtr->clusterSummary, numClusters*kClusterPlanes*sizeof(float));
+        }else{
+            memset(out9_bp, 0, kClusterPlanes*sizeof(float));
+        }
+        
+        //populate the 10th outlet with the density grid, a single 0 when it is off
+        if(densitySize > 0){
+            float *grid = frame ? frame->density : flockPtr->density;
+            for(long k=0; k<densitySize; k++){
+                for(long j=0; j<densitySize; j++){
+                    memcpy(out10_bp + k*out10_minfo.dimstride[2] + j*out10_minfo.dimstride[1],
+                           grid + (k*densitySize + j)*densitySize, densitySize*sizeof(float));
+                }
+            }
+        }else{
+            *(float *)out10_bp = 0;
+        }
+        
+        //populate the 11th outlet with the trails, newest row first, a single 0 when they are off
+        //and a column of 0 when every boid is culled
+        if(trailLength > 0 && trailBoids > 0){
+            if(frame){
+                for(long j=0; j<trailLength; j++){
+                    memcpy(out11_bp + j*out11_minfo.dimstride[1], frame->trail + j*trailBoids*3, trailBoids*3*sizeof(float));
+                }
+            }else{
+                TrailPack(flockPtr, out11_bp, out11_minfo.dimstride[1]);
+            }
+        }else{
+            for(long j=0; j<out11_minfo.dim[1]; j++){
+                memset(out11_bp + j*out11_minfo.dimstride[1], 0, 3*sizeof(float));
+            }
+        }
+        
+        //populate the 12th outlet with the result of the last query, a row of -1 -1 0 when it found nothing
+        if(queryDirty){
+            if(queryCount > 0){
+                memcpy(out12_bp, frame ? frame->queryResult : flockPtr->queryResult, queryCount*sizeof(flockPtr->queryResult[0]));
+            }else{
+                float *out12_data = (float*)out12_bp;
+                out12_data[0] = -1;
+                out12_data[1] = -1;
+                out12_data[2] = 0;
+            }
+            flockPtr->outputQueryVersion = queryVersion;
+        }
+        
         //get dimensions/planecount
         dimcount   = out_minfo.dimcount;
-        planecount = out_minfo.planecount;
+        planecount = halfOutput ? out_minfo.planecount/2 : out_minfo.planecount; //float planes
         
         for (i=0;i<dimcount;i++) {
             dim[i] = out_minfo.dim[i];
         }
         
         //populate the first outlet matrix with data
-        jit_boids3d_calculate_ndim(flockPtr, dimcount, dim, planecount, &out_minfo, out_bp);
+        if(halfOutput){
+            float *floats = frame ? frame->boids : flockPtr->halfStaging;
+            if(!frame){
+                jit_boids3d_calculate_ndim(flockPtr, dimcount, dim, planecount, &out_minfo, (char *)floats);
+            }
+            FloatsToHalves(floats, (half *)out_bp, numBoids*planecount);
+        }else if(frame){
+            memcpy(out_bp, frame->boids, numBoids*planecount*sizeof(float));
+        }else{
+            jit_boids3d_calculate_ndim(flockPtr, dimcount, dim, planecount, &out_minfo, out_bp);
+        }
+        
+        //without boids (all culled) the matrix keeps 1 row, which must not look like a boid
+        if(numBoids <= 0){
+            memset(out_bp, 0, out_minfo.dimstride[0]);
+        }
+        
+        //close the frame and populate the 5th outlet with the timing statistics
+        //(the simulation thread times its own frames while async)
+        TraceRecord(flockPtr, "packing", 'E');
+        if(frame){
+            memcpy(out5_bp, frame->timing, sizeof(frame->timing));
+        }else{
+            ProfileEnd(flockPtr, kProfilePacking, packingStart);
+            ProfileEnd(flockPtr, kProfileTotal, frameStart);
+            ProfileCommitFrame(flockPtr);
+            ProfileFillTiming(flockPtr, (float*)out5_bp);
+        }
         
     } else {
+        TraceRecord(flockPtr, "matrix_calc", 'E');
         return JIT_ERR_INVALID_PTR;
     }
     
 out: //output the matrix
     jit_object_method(out_matrix,gensym("lock"),out_savelock);
+    jit_object_method(out2_matrix,gensym("lock"),out2_savelock);
+    jit_object_method(out3_matrix,gensym("lock"),out3_savelock);
+    jit_object_method(out4_matrix,gensym("lock"),out4_savelock);
+    jit_object_method(out5_matrix,gensym("lock"),out5_savelock);
+    jit_object_method(out6_matrix,gensym("lock"),out6_savelock);
+    jit_object_method(out7_matrix,gensym("lock"),out7_savelock);
+    jit_object_method(out8_matrix,gensym("lock"),out8_savelock);
+    jit_object_method(out9_matrix,gensym("lock"),out9_savelock);
+    jit_object_method(out10_matrix,gensym("lock"),out10_savelock);
+    jit_object_method(out11_matrix,gensym("lock"),out11_savelock);
+    jit_object_method(out12_matrix,gensym("lock"),out12_savelock);
+    TraceRecord(flockPtr, "matrix_calc", 'E');
     return err;
 }
 
 /*
  Populates the first outlet matrix with the data (boids x,y,z etc)
+ The boids of flock 0 come first, then flock 1 and so on, each flock in one contiguous range (7th outlet),
+ less the ones cull leaves out. Depthsort orders them from the farthest to the nearest instead, and the 7th
+ outlet gives -1 -1 for every flock. The line indices of the 4th and the columns of the 11th follow these rows.
+ Copies the render mirror when the last FlightStep wrote it in this layout, otherwise packs the boids in parallel
  */
 void jit_boids3d_calculate_ndim(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
                                 t_jit_matrix_info *out_minfo, char *bop)
 {
+    t_jit_matrix_info pack_minfo;
+    long pack_dim[2];
+    
+    //whole steps in the layout of this output, all of them in list order: a single copy
+    if(flockPtr->stepAlpha >= 1.0 && !flockPtr->depthSort && !flockPtr->culling && flockPtr->mirrorLayout == flockPtr->outputLayout &&
+       flockPtr->mirrorPlanecount == planecount && flockPtr->mirrorCount == dim[0]){
+        memcpy(bop, flockPtr->renderMirror, flockPtr->mirrorCount*planecount*sizeof(float));
+        return;
+    }
     
-    float *fop;
-    double 	tempNew_x, tempNew_y, tempNew_z;
-    double 	tempOld_x, tempOld_y, tempOld_z;
-    double	delta_x, delta_y, delta_z, azi, ele, speed;
+    //PackOrder gathered the boids in output order so that rows can be packed independently,
+    //no more than the output was sized for
+    flockPtr->packCount = MIN(flockPtr->packCount, dim[0]);
+    flockPtr->packBase = bop;
     
-    fop = (float *)bop; //contains the data
+    //view the output as rows of kPackRowBoids boids, the last row may be partial
+    pack_dim[0] = kPackRowBoids;
+    pack_dim[1] = (flockPtr->packCount + kPackRowBoids - 1) / kPackRowBoids;
+    if(pack_dim[1] == 0){
+        return;
+    }
     
-    //pick the correct mode (to get the appropriate number of planes)
-    switch(flockPtr->mode) { // newpos
-        case 0:
-            for (int i=0; i<MAX_FLOCKS; i++){
-                BoidPtr iterator = flockPtr->flockLL[i];
-                
-                while (iterator){ //iterate thru the boids in the flock and add their info to the matrix
-                    fop[0] = iterator->newPos[x];
-                    fop[1] = iterator->newPos[y];
-                    fop[2] = iterator->newPos[z];
-                    fop[3] = iterator->flockID;
-                    
-                    fop += planecount;
-                    
-                    iterator = iterator->nextBoid;
-                }
-            }
-            break;
-        case 1:
-            for (int i=0; i<MAX_FLOCKS; i++){
-                BoidPtr iterator = flockPtr->flockLL[i];
-                
-                while (iterator){ //iterate thru the boids in the flock and add their info to the matrix
-                    fop[0] = iterator->newPos[x];
-                    fop[1] = iterator->newPos[y];
-                    fop[2] = iterator->newPos[z];
-                    fop[3] = iterator->flockID;
-                    fop[4] = iterator->oldPos[x];
-                    fop[5] = iterator->oldPos[y];
-                    fop[6] = iterator->oldPos[z];
-                    
-                    fop += planecount;
-                    
-                    iterator = iterator->nextBoid;
-                }
-            }
-            break;
-        case 2:
-            for (int i=0; i<MAX_FLOCKS; i++){
-                BoidPtr iterator = flockPtr->flockLL[i];
-                
-                while (iterator){ //iterate thru the boids in the flock and add their info to the matrix
-                    tempNew_x = iterator->newPos[x];
-                    tempNew_y = iterator->newPos[y];
-                    tempNew_z = iterator->newPos[z];
-                    tempOld_x = iterator->oldPos[x];
-                    tempOld_y = iterator->oldPos[y];
-                    tempOld_z = iterator->oldPos[z];
-                    
-                    delta_x = tempNew_x - tempOld_x;
-                    delta_y = tempNew_y - tempOld_y;
-                    delta_z = tempNew_z - tempOld_z;
-                    azi = jit_math_atan2(delta_z, delta_x) * flockPtr->r2d;
-                    ele = jit_math_atan2(delta_y, delta_x) * flockPtr->r2d;
-                    speed = jit_math_sqrt(delta_x * delta_x + delta_y * delta_y + delta_z * delta_z);
-                    
-                    fop[0] = tempNew_x;
-                    fop[1] = tempNew_y;
-                    fop[2] = tempNew_z;
-                    fop[3] = iterator->flockID;
-                    fop[4] = tempOld_x;
-                    fop[5] = tempOld_y;
-                    fop[6] = tempOld_z;
-                    fop[7] = speed;
-                    fop[8] = azi;
-                    fop[9] = ele;
-                    
-                    fop += planecount;
-                    
-                    iterator = iterator->nextBoid; //move to next boid
-                }
+    memset(&pack_minfo, 0, sizeof(pack_minfo));
+    pack_minfo.type = _jit_sym_float32;
+    pack_minfo.planecount = planecount;
+    pack_minfo.dimcount = 2;
+    pack_minfo.dim[0] = pack_dim[0];
+    pack_minfo.dim[1] = pack_dim[1];
+    pack_minfo.dimstride[0] = planecount*sizeof(float);
+    pack_minfo.dimstride[1] = kPackRowBoids*pack_minfo.dimstride[0];
+    pack_minfo.size = pack_dim[1]*pack_minfo.dimstride[1];
+    
+    if(flockPtr->packCount < kParallelPackBoids){
+        jit_boids3d_calculate_rows(flockPtr, 2, pack_dim, planecount, &pack_minfo, bop);
+    }else{
+        jit_parallel_ndim_simplecalc1((method)jit_boids3d_calculate_rows, flockPtr, 2, pack_dim, planecount, &pack_minfo, bop, 0);
+    }
+}
+
+/*
+ Packs the rows of gathered boids a worker of jit_boids3d_calculate_ndim was given
+ */
+void jit_boids3d_calculate_rows(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                                t_jit_matrix_info *out_minfo, char *bop)
+{
+    long firstRow = (bop - flockPtr->packBase) / out_minfo->dimstride[1];
+    
+    for (long j=0; j<dim[1]; j++){
+        float *fop = (float *)(bop + j*out_minfo->dimstride[1]);
+        long first = (firstRow + j) * kPackRowBoids;
+        long last = MIN(first + dim[0], flockPtr->packCount);
+        
+        for (long i=first; i<last; i++){
+            PackBoid(flockPtr, flockPtr->packBoids[i], flockPtr->stepAlpha, fop);
+            fop += planecount;
+        }
+    }
+}
+
+/*!
+    @brief Gives an output matrix new dimensions, type and planes, only if they changed
+    @param matrix The output matrix
+    @param info The info of the matrix, as returned by getinfo; updated when the matrix is resized
+    @param width dim[0], at least 1
+    @param height dim[1], at least 1
+    @return 1 if the matrix was resized, and so holds no data yet
+    @discussion setinfo reallocates and may adjust the info (dimstride), hence the getinfo that follows it
+ */
+char OutputMatrixInfo(void *matrix, t_jit_matrix_info *info, long width, long height, t_symbol *type, long planecount)
+{
+    width = MAX(width, 1);
+    height = MAX(height, 1);
+    
+    if(info->dim[0] == width && (info->dimcount < 2 || info->dim[1] == height) &&
+       info->type == type && info->planecount == planecount){
+        return 0;
+    }
+    
+    info->dim[0] = width;
+    info->dim[1] = height;
+    info->type = type;
+    info->planecount = planecount;
+    jit_object_method(matrix,_jit_sym_setinfo,info);
+    jit_object_method(matrix,_jit_sym_getinfo,info);
+    return 1;
+}
+
+
+/*!
+    @brief Gets the data of an output matrix and its info, without asking the matrix for the info when it was the last one output to
+    @param outlet 0 for the 1st outlet
+    @param info Filled with the info
+    @param data Filled with the data, NULL on failure
+    @discussion The cached info is only trusted for the matrix and data it was taken from, a matrix changed elsewhere
+                has new data and is asked again
+ */
+void OutputMatrixGetInfo(t_jit_boids3d *flockPtr, int outlet, void *matrix, t_jit_matrix_info *info, char **data)
+{
+    jit_object_method(matrix,_jit_sym_getdata,data);
+    
+    if(matrix == flockPtr->outputMatrix[outlet] && *data && *data == flockPtr->outputData[outlet]){
+        *info = flockPtr->outputInfo[outlet];
+        return;
+    }
+    
+    jit_object_method(matrix,_jit_sym_getinfo,info);
+    flockPtr->outputMatrix[outlet] = matrix;
+    flockPtr->outputData[outlet] = *data;
+    flockPtr->outputInfo[outlet] = *info;
+}
+
+
+/*!
+    @brief Gets the data of an output matrix again if OutputMatrixInfo() resized it, and caches its new info
+    @param outlet 0 for the 1st outlet
+    @param info The info of the matrix, after OutputMatrixInfo()
+    @param data The data from OutputMatrixGetInfo(), replaced if the matrix was resized
+ */
+void OutputMatrixGetData(t_jit_boids3d *flockPtr, int outlet, void *matrix, t_jit_matrix_info *info, char **data)
+{
+    if(memcmp(info, &flockPtr->outputInfo[outlet], sizeof(t_jit_matrix_info)) == 0){
+        return;
+    }
+    
+    jit_object_method(matrix,_jit_sym_getdata,data);
+    flockPtr->outputData[outlet] = *data;
+    flockPtr->outputInfo[outlet] = *info;
+}
+
+
+/*!
+    @brief Writes the selected fields of one boid in the layout of the 1st outlet
+    @param flockPtr A pointer to the flocks object
+    @param theBoid The boid
+    @param alpha Where the position lies between oldPos (0) and newPos (1)
+    @param fop The planes are written here, outputPlanecount floats
+    @discussion Only the fields that are output are computed
+ */
+void PackBoid(t_jit_boids3d *flockPtr, BoidPtr theBoid, double alpha, float *fop)
+{
+    double pos[3];
+    double delta_x = 0, delta_y = 0, delta_z = 0;
+    char haveDelta = 0;
+    
+    for(int i=0; i<flockPtr->numOutputFields; i++){
+        
+        int field = flockPtr->outputFields[i];
+        
+        //the last step, for the fields that describe it
+        if(!haveDelta && field >= kFieldSpeed && field <= kFieldVelocity){
+            delta_x = theBoid->newPos[x] - theBoid->oldPos[x];
+            delta_y = theBoid->newPos[y] - theBoid->oldPos[y];
+            delta_z = theBoid->newPos[z] - theBoid->oldPos[z];
+            haveDelta = 1;
+        }
+        
+        switch(field){
+            case kFieldPosition:
+                InterpolatePos(theBoid, alpha, pos);
+                fop[0] = pos[x];
+                fop[1] = pos[y];
+                fop[2] = pos[z];
+                break;
+            case kFieldFlockID:
+                fop[0] = theBoid->flockID;
+                break;
+            case kFieldOldPosition:
+                fop[0] = theBoid->oldPos[x];
+                fop[1] = theBoid->oldPos[y];
+                fop[2] = theBoid->oldPos[z];
+                break;
+            case kFieldSpeed:
+                fop[0] = jit_math_sqrt(delta_x * delta_x + delta_y * delta_y + delta_z * delta_z);
+                break;
+            case kFieldAzimuth:
+                fop[0] = jit_math_atan2(delta_z, delta_x) * flockPtr->r2d;
+                break;
+            case kFieldElevation:
+                fop[0] = jit_math_atan2(delta_y, delta_x) * flockPtr->r2d;
+                break;
+            case kFieldVelocity:
+                fop[0] = delta_x;
+                fop[1] = delta_y;
+                fop[2] = delta_z;
+                break;
+            case kFieldAge:
+                fop[0] = theBoid->age;
+                break;
+            case kFieldGlobalID:
+                fop[0] = theBoid->globalID;
+                break;
+            case kFieldDirection:
+                fop[0] = theBoid->newDir[x];
+                fop[1] = theBoid->newDir[y];
+                fop[2] = theBoid->newDir[z];
+                break;
+            case kFieldTexcoord:
+                fop[0] = 0;
+                fop[1] = 0;
+                break;
+            case kFieldColor:
+                fop[0] = flockPtr->flockColor[theBoid->flockID][0];
+                fop[1] = flockPtr->flockColor[theBoid->flockID][1];
+                fop[2] = flockPtr->flockColor[theBoid->flockID][2];
+                fop[3] = flockPtr->flockColor[theBoid->flockID][3];
+                break;
+            case kFieldQuat:
+                HeadingQuat(theBoid->newDir, fop);
+                break;
+            case kFieldScale:
+                fop[0] = flockPtr->flockScale[theBoid->flockID];
+                fop[1] = fop[0];
+                fop[2] = fop[0];
+                break;
+            case kFieldCluster:
+                fop[0] = theBoid->clusterID;
+                break;
+            case kFieldLOD:
+                InterpolatePos(theBoid, alpha, pos);
+                fop[0] = BoidLOD(flockPtr, pos);
+                break;
+        }
+        
+        fop += kOutputFieldPlanes[field];
+    }
+}
+
+/*!
+    @brief Computes the rotation that turns +z, the forward axis of the model, to a heading
+    @param dir The heading, need not be unit length
+    @param quat x, y, z, w are written here
+    @discussion The shortest arc: the axis is +z cross the heading, and (1 + cos, axis) normalized is
+                the quaternion of the full angle. Straight back (-z) turns about x; no heading is no rotation.
+ */
+void HeadingQuat(double *dir, float *quat)
+{
+    double length = jit_math_sqrt(dir[x]*dir[x] + dir[y]*dir[y] + dir[z]*dir[z]);
+    if(length <= 0){
+        quat[0] = 0; quat[1] = 0; quat[2] = 0; quat[3] = 1;
+        return;
+    }
+    
+    double qx = -dir[y]/length;
+    double qy = dir[x]/length;
+    double qw = 1.0 + dir[z]/length;
+    double norm = jit_math_sqrt(qx*qx + qy*qy + qw*qw);
+    if(norm < 1e-6){
+        quat[0] = 1; quat[1] = 0; quat[2] = 0; quat[3] = 0;
+        return;
+    }
+    
+    quat[0] = qx/norm;
+    quat[1] = qy/norm;
+    quat[2] = 0;
+    quat[3] = qw/norm;
+}
+
+/*!
+    @brief Returns the number of planes of the 1st outlet, always at least 1
+ */
+long OutputPlanecount(t_jit_boids3d *flockPtr)
+{
+    return flockPtr->outputPlanecount;
+}
+
+/*!
+    @brief Recomputes the fields of the 1st outlet after mode or outputplanes changed
+    @param flockPtr A pointer to the flocks object
+    @discussion Bumps outputLayout so that a render mirror written with the old fields is not copied.
+                A list without any known field falls back to the bundle of the mode, and an unknown mode to mode 0,
+                so the 1st outlet always has fields.
+ */
+void OutputLayoutUpdate(t_jit_boids3d *flockPtr)
+{
+    flockPtr->numOutputFields = 0;
+    
+    for(long i=0; i<flockPtr->outputPlanesCount; i++){
+        for(int j=0; j<kNumOutputFields; j++){
+            if(flockPtr->outputPlanes[i] == gensym(kOutputFieldNames[j])){
+                flockPtr->outputFields[flockPtr->numOutputFields++] = j;
+                break;
             }
+        }
+    }
+    
+    if(flockPtr->numOutputFields > 0){
+        //the listed fields
+    }else if(flockPtr->mode == 3){
+        //the planes of a Jitter geometry matrix: x y z, s t, nx ny nz, r g b a
+        static const char meshFields[4] = {kFieldPosition, kFieldTexcoord, kFieldDirection, kFieldColor};
+        
+        flockPtr->numOutputFields = 4;
+        memcpy(flockPtr->outputFields, meshFields, flockPtr->numOutputFields);
+    }else if(flockPtr->mode == 4){
+        //the position, quat and scale matrices of instanced drawing, in one
+        static const char instanceFields[3] = {kFieldPosition, kFieldQuat, kFieldScale};
+        
+        flockPtr->numOutputFields = 3;
+        memcpy(flockPtr->outputFields, instanceFields, flockPtr->numOutputFields);
+    }else{
+        //the bundles of the modes are prefixes of the same list:
+        //newpos (0), + oldpos (1), + speed-azimuth-elevation (2)
+        static const char modeFields[6] = {kFieldPosition, kFieldFlockID, kFieldOldPosition, kFieldSpeed, kFieldAzimuth, kFieldElevation};
+        static const long modeFieldCount[3] = {2, 3, 6};
+        
+        flockPtr->numOutputFields = modeFieldCount[(flockPtr->mode >= 0 && flockPtr->mode <= 2) ? (int)flockPtr->mode : 0];
+        memcpy(flockPtr->outputFields, modeFields, flockPtr->numOutputFields);
+    }
+    
+    //drop the fields that don't fit
+    flockPtr->outputPlanecount = 0;
+    for(long i=0; i<flockPtr->numOutputFields; i++){
+        if(flockPtr->outputPlanecount + kOutputFieldPlanes[(int)flockPtr->outputFields[i]] > kMaxOutputPlanes){
+            flockPtr->numOutputFields = i;
             break;
+        }
+        flockPtr->outputPlanecount += kOutputFieldPlanes[(int)flockPtr->outputFields[i]];
+    }
+    
+    flockPtr->outputLayout++;
+}
+
+
+static int CompareBoidRows(const void *a, const void *b)
+{
+    return ((const BoidRow *)a)->globalID - ((const BoidRow *)b)->globalID;
+}
+
+/*!
+    @brief Finds the rows of the ends of every neighbor line in the 1st outlet
+    @param flockPtr A pointer to the flocks object
+    @discussion The rows are those of packBoids, so PackOrder has to have gathered and sorted them.
+                An end that died after the line was made or that cull left out gets -1. The rows are
+                sorted by global id once, then every end is a binary search.
+ */
+void LineIndexUpdate(t_jit_boids3d *flockPtr)
+{
+    int numRows = flockPtr->packCount;
+    for(int i=0; i<numRows; i++){
+        flockPtr->lineRows[i].globalID = flockPtr->packBoids[i]->globalID;
+        flockPtr->lineRows[i].row = i;
+    }
+    qsort(flockPtr->lineRows, numRows, sizeof(BoidRow), CompareBoidRows);
+    
+    for(int i=0; i<flockPtr->sizeOfNeighborhoodConnections; i++){
+        NeighborLinePtr line = flockPtr->neighborhoodConnections[i];
+        BoidRow key, *found;
+        
+        key.globalID = line->aID;
+        found = bsearch(&key, flockPtr->lineRows, numRows, sizeof(BoidRow), CompareBoidRows);
+        line->index[0] = found ? found->row : -1;
+        
+        key.globalID = line->bID;
+        found = bsearch(&key, flockPtr->lineRows, numRows, sizeof(BoidRow), CompareBoidRows);
+        line->index[1] = found ? found->row : -1;
     }
 }
 
@@ -1045,26 +2873,79 @@ void jit_boids3d_calculate_ndim(t_jit_boids3d *flockPtr, long dimcount, long *di
 /*!
     @brief This method performs the velocity and position updates for all the boids
     @param flockPtr A pointer to the flocks object
+    @param sideOutputs 0 to skip the render mirror, neighbor lines, histograms, statistics, clusters and density of this step
  */
-void FlightStep(t_jit_boids3d *flockPtr)
+void FlightStep(t_jit_boids3d *flockPtr, char sideOutputs)
 {
     //All velocities start out at 0, otherwise weird boid velocities may happen
     double			goCenterVel[3] = {0,0,0};
     double			goAttractVel[3] = {0,0,0};
     double			matchNeighborVel[3] = {0,0,0};
     double			separationNeighborVel[3] = {0,0,0};
+    double          phaseStart;
+    double          stepStart = (flockPtr->budget > 0) ? systimer_gettime() : 0.0;
+    int             stagger = kBudgetStagger[flockPtr->budgetLevel]; //boids refresh their neighbor search every stagger steps
+    long            mirrorPlanecount = OutputPlanecount(flockPtr);
+    float           *mirror = flockPtr->renderMirror; //next boid of the render mirror
+    char            mirroring = sideOutputs && !flockPtr->depthSort && !flockPtr->culling; //steps that aren't output as they are don't pack
+    long            boidIndex = 0; //boids stepped so far, picks the timed samples
+    
+    //the side outputs this step builds
+    flockPtr->stepLines = sideOutputs && flockPtr->drawingNeighbors;
+    flockPtr->stepHistograms = sideOutputs && flockPtr->histogramming;
+    flockPtr->stepFlockStats = sideOutputs && flockPtr->flockStatsOn;
+    flockPtr->stepClusters = sideOutputs && flockPtr->clustering;
+    flockPtr->stepAttractorStats = sideOutputs && flockPtr->attractorStatsOn;
+    flockPtr->stepDensity = sideOutputs && flockPtr->densitySize > 0;
     
     //Initialize the lines
     flockPtr->sizeOfNeighborhoodConnections = 0;
     
+    //where the boids of each flock can be found by the neighbor searches of this step
+    FlockBoundsUpdate(flockPtr);
+    
+    //Clear the histograms of the last step
+    if(flockPtr->stepHistograms){
+        memset(flockPtr->neighborHistogram, 0, sizeof(flockPtr->neighborHistogram));
+        memset(flockPtr->candidateHistogram, 0, sizeof(flockPtr->candidateHistogram));
+    }
+    
+    //and the statistics
+    if(flockPtr->stepFlockStats){
+        for(int i=0; i<MAX_FLOCKS; i++){
+            FlockStatsClear(&flockPtr->flockStats[i]);
+        }
+    }
+    
+    //every boid starts as its own cluster
+    if(flockPtr->stepClusters){
+        ClusterBegin(flockPtr);
+    }
+    
+    //the oldest positions of the trails are overwritten
+    if(flockPtr->trailLength > 0){
+        flockPtr->trailHead = (flockPtr->trailHead + 1) % flockPtr->trailLength;
+    }
+    
+    //no boids around the attractors yet
+    for(AttractorPtr attractor = flockPtr->attractorLL; flockPtr->stepAttractorStats && attractor; attractor = attractor->nextAttractor){
+        AttractorStatsClear(&attractor->stepStats);
+    }
+    
     //get every boid from every flock
+    double loopStart = ProfileBegin(flockPtr);
+    memset(flockPtr->sampleTime, 0, sizeof(flockPtr->sampleTime));
     for (int i=0; i<MAX_FLOCKS; i++){
         BoidPtr iterator = flockPtr->flockLL[i];
         BoidPtr prevBoid = NULL;
         
         while(iterator){ //grab every boid from this flock
             
+            //only a few boids time their phases, a timer call costs about as much as a phase
+            flockPtr->profileSample = (boidIndex++ % kProfileSampleStride) == 0;
+            
             //update age and check if it's this boid's time to die
+            phaseStart = ProfileSampleBegin(flockPtr);
             iterator->age++;
             if(iterator->age > flockPtr->age[iterator->flockID] && flockPtr->age[iterator->flockID] != -1){
                 
@@ -1076,20 +2957,25 @@ void FlightStep(t_jit_boids3d *flockPtr)
                 if(!prevBoid){ //this boid is at the head of the linked list
                     deletor = iterator;
                     iterator = iterator->nextBoid;
+                    TrailRelease(flockPtr, deletor);
                     free(deletor);
                     flockPtr->flockLL[i] = iterator;
                     
                 }else{ //this boid is somewhere in the middle of the LL
                     iterator = iterator->nextBoid;
+                    TrailRelease(flockPtr, deletor);
                     free(deletor);
                     prevBoid->nextBoid = iterator;
                 }
                 
                 //update boid pointers and count and move to next boid
                 flockPtr->boidCount[i]--;
+                flockPtr->countsVersion++;
+                ProfileSampleEnd(flockPtr, kProfileAging, phaseStart);
                 continue;
                 
             }
+            ProfileSampleEnd(flockPtr, kProfileAging, phaseStart);
             
             //save position and velocity
             iterator->oldPos[x] = iterator->newPos[x];
@@ -1103,9 +2989,27 @@ void FlightStep(t_jit_boids3d *flockPtr)
             //calculate velocity updates
             int flockID = iterator->flockID;
             
-            CalcFlockCenterAndNeighborVel(flockPtr, iterator, matchNeighborVel,  separationNeighborVel);
+            if(stagger > 1 && iterator->neighborStep >= 0 && (iterator->globalID + flockPtr->stepCount) % stagger != 0){
+                
+                //over budget: reuse this boid's last neighbor search
+                for(int j=0; j<3; j++){
+                    flockPtr->tempCenterPt[j] = iterator->neighborCenter[j];
+                    matchNeighborVel[j] = iterator->neighborMatch[j];
+                    separationNeighborVel[j] = iterator->neighborSeparation[j];
+                }
+                
+            }else{
+                
+                //neighbor lines are timed on their own inside the neighbor search
+                double linesBefore = flockPtr->sampleTime[kProfileLines];
+                phaseStart = ProfileSampleBegin(flockPtr);
+                CalcFlockCenterAndNeighborVel(flockPtr, iterator, matchNeighborVel,  separationNeighborVel);
+                ProfileSampleEnd(flockPtr, kProfileNeighbors, phaseStart);
+                flockPtr->sampleTime[kProfileNeighbors] -= flockPtr->sampleTime[kProfileLines] - linesBefore;
+            }
             
             //update velocity to include centering and attracting instincts
+            phaseStart = ProfileSampleBegin(flockPtr);
             SeekPoint(flockPtr, iterator, flockPtr->tempCenterPt, goCenterVel);
             
             //Seek the attractors
@@ -1127,8 +3031,10 @@ void FlightStep(t_jit_boids3d *flockPtr)
              flockPtr->attract[flockID] * goAttractVel[z] +
              flockPtr->match[flockID] * matchNeighborVel[z] +
              flockPtr->sepwt[flockID] * separationNeighborVel[z]) / flockPtr->inertia[flockID];
+            ProfileSampleEnd(flockPtr, kProfileSteering, phaseStart);
             
             //calculate the speed by finding the magnitude of all velocity components
+            phaseStart = ProfileSampleBegin(flockPtr);
             double newSpeed = sqrt(pow(iterator->newDir[x],2) + pow(iterator->newDir[y],2) + pow(iterator->newDir[z],2));
             
             NormalizeVelocity(iterator->newDir);	// normalize velocity so its length is unified
@@ -1141,16 +3047,35 @@ void FlightStep(t_jit_boids3d *flockPtr)
                 iterator->speed = flockPtr->maxspeed[flockID];
             else
                 iterator->speed = flockPtr->minspeed[flockID];
+            ProfileSampleEnd(flockPtr, kProfileIntegration, phaseStart);
             
             
             
             //bounce back from walls if the boid is beyond the limit of the flyrect
+            phaseStart = ProfileSampleBegin(flockPtr);
             AvoidWalls(flockPtr, iterator, iterator->newDir);
+            ProfileSampleEnd(flockPtr, kProfileWalls, phaseStart);
             
             // calculate new position, applying speed
+            phaseStart = ProfileSampleBegin(flockPtr);
             iterator->newPos[x] += iterator->newDir[x] * (0.5*iterator->speed) * (flockPtr->speed[flockID] / 100.0);
             iterator->newPos[y] += iterator->newDir[y] * (0.5*iterator->speed) * (flockPtr->speed[flockID] / 100.0);
             iterator->newPos[z] += iterator->newDir[z] * (0.5*iterator->speed) * (flockPtr->speed[flockID] / 100.0);
+            ProfileSampleEnd(flockPtr, kProfileIntegration, phaseStart);
+            
+            //the boid is final for this step, write it to the render mirror and the statistics
+            phaseStart = ProfileSampleBegin(flockPtr);
+            if(mirroring){
+                PackBoid(flockPtr, iterator, 1.0, mirror);
+                mirror += mirrorPlanecount;
+            }
+            if(flockPtr->stepFlockStats){
+                FlockStatsAdd(&flockPtr->flockStats[flockID], iterator);
+            }
+            if(flockPtr->trailLength > 0){
+                TrailAdd(flockPtr, iterator);
+            }
+            ProfileSampleEnd(flockPtr, kProfilePacking, phaseStart);
             
             //move to next boid
             prevBoid = iterator;
@@ -1159,25 +3084,90 @@ void FlightStep(t_jit_boids3d *flockPtr)
         }
         
     }
+    flockPtr->profileSample = 0;
+    ProfileSampleCommit(flockPtr, loopStart);
+    
+    //the attractor statistics of this step are complete
+    for(AttractorPtr attractor = flockPtr->attractorLL; flockPtr->stepAttractorStats && attractor; attractor = attractor->nextAttractor){
+        attractor->stats = attractor->stepStats;
+    }
+    
+    //splat the boids into the density grid
+    if(flockPtr->stepDensity){
+        phaseStart = ProfileBegin(flockPtr);
+        DensityUpdate(flockPtr);
+        ProfileEnd(flockPtr, kProfilePacking, phaseStart);
+    }
+    
+    //label the clusters the neighbor search joined
+    if(flockPtr->stepClusters){
+        phaseStart = ProfileBegin(flockPtr);
+        ClusterLabel(flockPtr);
+        ProfileEnd(flockPtr, kProfilePacking, phaseStart);
+    }
+    
+    flockPtr->stepCount++;
+    flockPtr->mirrorCount = (mirror - flockPtr->renderMirror) / MAX(mirrorPlanecount, 1);
+    flockPtr->mirrorPlanecount = mirroring ? mirrorPlanecount : 0; //out of date, calculate_ndim packs instead
+    flockPtr->mirrorLayout = flockPtr->outputLayout;
+    
+    //the mirror was written before the clusters were labeled, and the camera can move before it is output
+    for(int i=0; i<flockPtr->numOutputFields; i++){
+        if((flockPtr->stepClusters && flockPtr->outputFields[i] == kFieldCluster) || flockPtr->outputFields[i] == kFieldLOD){
+            flockPtr->mirrorLayout = flockPtr->outputLayout - 1;
+        }
+    }
+    
+    //adapt the amount of work to the budget
+    if(flockPtr->budget > 0){
+        BudgetUpdate(flockPtr, systimer_gettime() - stepStart);
+    }
 }
 
 
 /*!
-    @brief Calculates the center of a flock and saves it in flockPtr->centerPt
-                Computes the avoid and matching of neighbor velocities
+    @brief Moves between degradation levels so that FlightStep stays within the frame budget
     @param flockPtr A pointer to the flocks object
-    @param theBoid  The boid object that the calculations are performed for
-    @param matchNeighborVel A reference to the matching velocity array in FlightStep()
-    @param separationNeighborVel A reference to a separation velocity array in FlightStep()
+    @param stepTime How long the last step took, in ms
+    @discussion The step time is smoothed; a level is only changed after the current one had time to settle,
+                and quality is restored only once the step is well under budget
  */
-void CalcFlockCenterAndNeighborVel(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *matchNeighborVel, double *separationNeighborVel)
+void BudgetUpdate(t_jit_boids3d *flockPtr, double stepTime)
 {
-    //TODO: avoid speed is never used
+    flockPtr->budgetSmoothed = (flockPtr->budgetSmoothed == 0.0) ? stepTime : 0.9*flockPtr->budgetSmoothed + 0.1*stepTime;
+    flockPtr->budgetFramesAtLevel++;
+    
+    if(flockPtr->budgetSmoothed > flockPtr->budget && flockPtr->budgetLevel < kNumBudgetLevels-1 &&
+       flockPtr->budgetFramesAtLevel >= kBudgetSettleFrames){
+        flockPtr->budgetLevel++;
+        flockPtr->budgetFramesAtLevel = 0;
+        TraceRecord(flockPtr, "budget degrade", 'i');
+    }else if(flockPtr->budgetSmoothed < flockPtr->budget*kBudgetRecoverRatio && flockPtr->budgetLevel > 0 &&
+             flockPtr->budgetFramesAtLevel >= kBudgetRecoverFrames){
+        flockPtr->budgetLevel--;
+        flockPtr->budgetFramesAtLevel = 0;
+        TraceRecord(flockPtr, "budget restore", 'i');
+    }
+}
+
+
+/*!
+    @brief Calculates the center of a flock and saves it in flockPtr->centerPt
+                Computes the avoid and matching of neighbor velocities
+    @param flockPtr A pointer to the flocks object
+    @param theBoid  The boid object that the calculations are performed for
+    @param matchNeighborVel A reference to the matching velocity array in FlightStep()
+    @param separationNeighborVel A reference to a separation velocity array in FlightStep()
+ */
+void CalcFlockCenterAndNeighborVel(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *matchNeighborVel, double *separationNeighborVel)
+{
+    //TODO: avoid speed is never used
     
     
     //Variables for centering
     int flockID = theBoid->flockID;
     double totalH = 0, totalV = 0, totalD = 0;
+    double centerWeight = 0; //neighborsCount, with the cohesion weights of the neighbors
     
     //Matching
     matchNeighborVel[x] = 0;
@@ -1188,44 +3178,58 @@ void CalcFlockCenterAndNeighborVel(t_jit_boids3d *flockPtr, BoidPtr theBoid, dou
     double avoidSpeed = theBoid->speed;
     int neighborsCount = 0; //counter to keep track of how many neighbors we've found
     
+    //Variables for the histograms
+    long neighborsFound = 0, candidatesTested = 0;
+    
+    //neighbor cap of the current budget level, 0 = no cap
+    int neighborCap = kBudgetNeighborCap[flockPtr->budgetLevel];
+    
     //int startAddingBoidLines = 0;
     
     for(int i=0; i<MAX_FLOCKS; i++){ //grab every boid
         
+        //skip whole flocks this boid doesn't see, or that are too far away to hold a neighbor
+        //(the reference of the golden harness tests their boids one by one)
+        char sees = FlockSees(flockPtr, flockID, i);
+        if(!flockPtr->flockSkipOff && (!sees || FlockBoundsDist(flockPtr, i, theBoid->oldPos) >= flockPtr->neighborRadius[flockID])){
+            continue;
+        }
+        double *weights = flockPtr->flockWeights[flockID][i]; //cohesion, alignment, separation
+        
         BoidPtr iterator = flockPtr->flockLL[i];
         
         while(iterator){
             
             double dist = sqrt(DistSqrToPt(theBoid->oldPos, iterator->oldPos));
+            candidatesTested++; //only the flocks that weren't skipped
             
-            if(dist < flockPtr->neighborRadius[flockID] && dist > 0.0 && neighborsCount < kMaxNeighbors){ //check if this boid is close enough to be a neighbor
-                
-                //check to ensure this boid is allowed / in same flock
-                if (flockPtr->allowNeighborsFromDiffFlock == 0 && iterator->flockID != flockID){
-                    iterator = iterator->nextBoid;
-                    continue;
-                }
+            if(sees && dist < flockPtr->neighborRadius[flockID] && dist > 0.0 && neighborsCount < kMaxNeighbors){ //check if this boid is close enough to be a neighbor
                 
                 //this boid is a neighbor
+                neighborsFound++;
+                if(flockPtr->stepClusters){
+                    ClusterUnion(flockPtr, theBoid->clusterSlot, iterator->clusterSlot);
+                }
                 
                 //TODO: populate neighborhoodLines here
                 
                 //centering
                 neighborsCount++;
-                totalH += iterator->oldPos[x];
-                totalV += iterator->oldPos[y];
-                totalD += iterator->oldPos[z];
+                centerWeight += weights[0];
+                totalH += weights[0] * iterator->oldPos[x];
+                totalV += weights[0] * iterator->oldPos[y];
+                totalD += weights[0] * iterator->oldPos[z];
                 
                 //matching
-                matchNeighborVel[x] += iterator->oldDir[x];
-                matchNeighborVel[y] += iterator->oldDir[y];
-                matchNeighborVel[z] += iterator->oldDir[z];
+                matchNeighborVel[x] += weights[1] * iterator->oldDir[x];
+                matchNeighborVel[y] += weights[1] * iterator->oldDir[y];
+                matchNeighborVel[z] += weights[1] * iterator->oldDir[z];
                 
                 //separation
                 if(dist < flockPtr->sepdist[flockID]){
-                    separationNeighborVel[x] += (theBoid->oldPos[x] - iterator->oldPos[x])/dist;
-                    separationNeighborVel[y] += (theBoid->oldPos[y] - iterator->oldPos[y])/dist;
-                    separationNeighborVel[z] += (theBoid->oldPos[z] - iterator->oldPos[z])/dist;
+                    separationNeighborVel[x] += weights[2] * (theBoid->oldPos[x] - iterator->oldPos[x])/dist;
+                    separationNeighborVel[y] += weights[2] * (theBoid->oldPos[y] - iterator->oldPos[y])/dist;
+                    separationNeighborVel[z] += weights[2] * (theBoid->oldPos[z] - iterator->oldPos[z])/dist;
                 }
                 
                 if (InFront((theBoid), iterator)) {	// adjust speed
@@ -1236,8 +3240,9 @@ void CalcFlockCenterAndNeighborVel(t_jit_boids3d *flockPtr, BoidPtr theBoid, dou
                 }
                 
                 //Check if a line needs to be drawn between these boids
-                if(flockPtr->sizeOfNeighborhoodConnections < kMaxNeighborLines && flockPtr->drawingNeighbors) {
+                if(flockPtr->sizeOfNeighborhoodConnections < kMaxNeighborLines && flockPtr->stepLines) {
                    
+                    double linesStart = ProfileSampleBegin(flockPtr);
                     int lineAlreadyExists = 0;
                     
                     //Check to see if this line has already been added from another boid
@@ -1257,6 +3262,7 @@ void CalcFlockCenterAndNeighborVel(t_jit_boids3d *flockPtr, BoidPtr theBoid, dou
                         NeighborLinePtr newLine = InitNeighborhoodLine(flockPtr, theBoid, iterator);
                         if(!newLine){
                             post("ERROR: Failed to allocate a line");
+                            ProfileSampleEnd(flockPtr, kProfileLines, linesStart);
                             continue;
                         }
                         
@@ -1264,10 +3270,16 @@ void CalcFlockCenterAndNeighborVel(t_jit_boids3d *flockPtr, BoidPtr theBoid, dou
                         flockPtr->neighborhoodConnections[flockPtr->sizeOfNeighborhoodConnections] = newLine;
                         flockPtr->sizeOfNeighborhoodConnections++;
                     }
+                    ProfileSampleEnd(flockPtr, kProfileLines, linesStart);
                     
                 }
                 
                 neighborsCount++;
+                centerWeight += weights[0];
+                
+                if(neighborCap && neighborsFound >= neighborCap){
+                    goto searchDone;
+                }
                 
             }
             /*else if(dist == 0.0 && iterator->flockID == theBoid->flockID){
@@ -1280,259 +3292,2548 @@ void CalcFlockCenterAndNeighborVel(t_jit_boids3d *flockPtr, BoidPtr theBoid, dou
         }
     }
     
+searchDone:
+    
+    //add this boid to its flock's histograms
+    if(flockPtr->stepHistograms){
+        flockPtr->neighborHistogram[flockID][MIN(neighborsFound/kNeighborBinWidth, kHistogramBins-1)]++;
+        flockPtr->candidateHistogram[flockID][MIN(candidatesTested/kCandidateBinWidth, kHistogramBins-1)]++;
+    }
+    
     //normalize the velocities
     NormalizeVelocity(matchNeighborVel);
     NormalizeVelocity(separationNeighborVel);
     
     //update the center point as an average of theBoid's neighbors
-    if(neighborsCount > 0){ //get the average position of all boids in the flock
-        flockPtr->tempCenterPt[x] = (double)	(totalH / neighborsCount);
-        flockPtr->tempCenterPt[y] = (double)	(totalV / neighborsCount);
-        flockPtr->tempCenterPt[z] = (double)	(totalD / neighborsCount);
+    if(centerWeight > 0){ //get the average position of all boids in the flock
+        flockPtr->tempCenterPt[x] = (double)	(totalH / centerWeight);
+        flockPtr->tempCenterPt[y] = (double)	(totalV / centerWeight);
+        flockPtr->tempCenterPt[z] = (double)	(totalD / centerWeight);
     }else{ //only boid in flock, its position is the center point
         flockPtr->tempCenterPt[x] = theBoid->oldPos[x];
         flockPtr->tempCenterPt[y] = theBoid->oldPos[y];
         flockPtr->tempCenterPt[z] = theBoid->oldPos[z];
     }
+    
+    //remember the result for staggered budget levels
+    for(int i=0; i<3; i++){
+        theBoid->neighborCenter[i] = flockPtr->tempCenterPt[i];
+        theBoid->neighborMatch[i] = matchNeighborVel[i];
+        theBoid->neighborSeparation[i] = separationNeighborVel[i];
+    }
+    theBoid->neighborStep = flockPtr->stepCount;
+}
+
+
+/*!
+    @brief Determines if the boids of one flock look for neighbors in another flock
+    @param observer The flock of the boid searching for neighbors
+    @param seen The flock of the candidates
+    @return 1 if it does, 0 if not
+ */
+char FlockSees(t_jit_boids3d *flockPtr, int observer, int seen)
+{
+    if(flockPtr->flockSees[observer][seen] >= 0){
+        return flockPtr->flockSees[observer][seen];
+    }
+    return observer == seen || flockPtr->allowNeighborsFromDiffFlock;
+}
+
+
+/*!
+    @brief Bounds the positions the boids of each flock can be found at by the neighbor searches of a step
+    @param flockPtr A pointer to the flocks object
+    @discussion A boid is found at oldPos before FlightStep gets to it and at newPos after, so both count
+ */
+void FlockBoundsUpdate(t_jit_boids3d *flockPtr)
+{
+    for(int i=0; i<MAX_FLOCKS; i++){
+        double *bounds = flockPtr->flockBounds[i];
+        for(int j=0; j<3; j++){
+            bounds[j] = DBL_MAX;
+            bounds[3+j] = -DBL_MAX;
+        }
+        
+        for(BoidPtr iterator = flockPtr->flockLL[i]; iterator; iterator = iterator->nextBoid){
+            for(int j=0; j<3; j++){
+                bounds[j] = MIN(bounds[j], MIN(iterator->oldPos[j], iterator->newPos[j]));
+                bounds[3+j] = MAX(bounds[3+j], MAX(iterator->oldPos[j], iterator->newPos[j]));
+            }
+        }
+    }
+}
+
+
+/*!
+    @brief Returns the distance from a point to the bounds of a flock, 0 inside them
+    @discussion Never more than the distance to any boid of the flock as computed by the neighbor
+                search, so a flock farther than the neighbor radius holds no neighbor
+ */
+double FlockBoundsDist(t_jit_boids3d *flockPtr, int flockID, double *pos)
+{
+    double *bounds = flockPtr->flockBounds[flockID];
+    double nearest[3];
+    
+    if(bounds[0] > bounds[3]){ //no boids
+        return DBL_MAX;
+    }
+    
+    for(int j=0; j<3; j++){
+        nearest[j] = CLAMP(pos[j], bounds[j], bounds[3+j]);
+    }
+    return sqrt(DistSqrToPt(pos, nearest));
+}
+
+
+/*!
+    @brief Computes a normalized direction vector from a boid to a seek point
+    @param flockPtr A pointer to the flocks object
+    @param theBoid The boid object that the direction vector is calculated for
+    @param seekPt The point that the boid is seeking
+    @param seekDir The calculated direction is stored here
+ */
+void SeekPoint(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *seekPt, double* seekDir)
+{
+    seekDir[x] = seekPt[x] - theBoid->oldPos[x];
+    seekDir[y] = seekPt[y] - theBoid->oldPos[y];
+    seekDir[z] = seekPt[z] - theBoid->oldPos[z];
+    NormalizeVelocity(seekDir);
+}
+
+
+
+/*!
+    @brief Computes a normalized seek direction from a boid towards every attractor
+    @param flockPtr A pointer to the flocks object
+    @param theBoid The boid object that the direction vector is calculated for
+    @param seekDir The calculated direction is stored here
+    @discussion With attractorstats on, the distances are also added to the statistics of the attractors.
+                Boids of every flock count, including the ones the attractor does not pull.
+ */
+void SeekAttractors(t_jit_boids3d *flockPtr, BoidPtr theBoid, double* seekDir)
+{
+    AttractorPtr iterator = flockPtr->attractorLL;
+    
+    //iterate thru and sum up the direction to all attractors
+    while(iterator){
+        
+        double dist = sqrt(DistSqrToPt(iterator->loc, theBoid->oldPos));
+        
+        if(flockPtr->stepAttractorStats){
+            AttractorStatsAdd(&iterator->stepStats, theBoid, dist, iterator->attractorRadius);
+        }
+        
+        //ensure that the boid is in range of the attractor and it is allowed to feel attraction to this attractor
+        if(dist < iterator->attractorRadius && (iterator->onlyAttractedFlockID == -1 || iterator->onlyAttractedFlockID == theBoid->flockID)){
+            seekDir[x] += iterator->loc[x]-theBoid->oldPos[x];
+            seekDir[y] += iterator->loc[y]-theBoid->oldPos[y];
+            seekDir[z] += iterator->loc[z]-theBoid->oldPos[z];
+        }
+        
+        iterator = iterator->nextAttractor;
+    }
+    
+    NormalizeVelocity(seekDir);
+}
+
+
+/*!
+    @brief Bounces boids back from the walls of the simulation if necessary
+    @param flockPtr A point to the flocks object
+    @param theBoid The boid object that is being bounced back from the walls
+    @param wallVel The resulting direction after bouncing off the wall
+ */
+void AvoidWalls(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *wallVel)
+{
+    double		testPoint[3];
+    
+    /* calculate test point in front of the nose of the boid */
+    /* distance depends on the boid's speed and the avoid edge constant */
+    testPoint[x] = theBoid->oldPos[x] + theBoid->newDir[x] * (theBoid->speed * (flockPtr->speed[theBoid->flockID] / 100.0));// * flockPtr->edgedist[flockPtr->boid[theBoid].flockID];
+    testPoint[y] = theBoid->oldPos[y] + theBoid->newDir[y] * (theBoid->speed * (flockPtr->speed[theBoid->flockID] / 100.0));// * flockPtr->edgedist[flockPtr->boid[theBoid].flockID];
+    testPoint[z] = theBoid->oldPos[z] + theBoid->newDir[z] * (theBoid->speed * (flockPtr->speed[theBoid->flockID] / 100.0));// * flockPtr->edgedist[flockPtr->boid[theBoid].flockID];
+    
+    
+    /* if test point is out of the left (right) side of flockPtr->flyrect, */
+    /* return a positive (negative) horizontal velocity component */
+    if (testPoint[x] < flockPtr->flyrect[left]*kFlyRectScalingFactor)
+        wallVel[x] = ABS(wallVel[x]);
+    else if (testPoint[x] > flockPtr->flyrect[right]*kFlyRectScalingFactor)
+        wallVel[x] = - ABS(wallVel[x]);
+    
+    /* same with top and bottom */
+    if (testPoint[y] > flockPtr->flyrect[top]*kFlyRectScalingFactor)
+        wallVel[y] = - ABS(wallVel[y]);
+    else if (testPoint[y] < flockPtr->flyrect[bottom]*kFlyRectScalingFactor)
+        wallVel[y] = ABS(wallVel[y]);
+    
+    /* same with front and back*/
+    if (testPoint[z] > flockPtr->flyrect[front]*kFlyRectScalingFactor)
+        wallVel[z] = - ABS(wallVel[z]);
+    else if (testPoint[z] < flockPtr->flyrect[back]*kFlyRectScalingFactor)
+        wallVel[z] = ABS(wallVel[z]);
+}
+
+
+/*!
+    @brief Determines if a neighbor boid is in front of a given boid
+    @param theBoid A boid
+    @param neighbor A different boid - calculates if this boid is in front of theBoid
+    @return 0 if neighbor is not in front, 1 if it is
+ */
+char InFront(BoidPtr theBoid, BoidPtr neighbor)
+{
+    float	grad, intercept;
+    char result;
+    
+    /* we do this on 2 planes, xy, yz. if one returns false then we know its behind. a.sier/jasch 08/2005
+     
+     Find the gradient and y-intercept of a line passing through theBoid's oldPos
+     perpendicular to its direction of motion.  Another boid is in front of theBoid
+     if it is to the right or left of this linedepending on whether theBoid is moving
+     right or left.  However, if theBoid is travelling vertically then just compare
+     their vertical coordinates.
+     
+     */
+    // xy plane
+    
+    // if theBoid is not travelling vertically...
+    if (theBoid->oldDir[x] != 0) {
+        // calculate gradient of a line _perpendicular_ to its direction (hence the minus)
+        grad = -theBoid->oldDir[y] / theBoid->oldDir[x];
+        
+        // calculate where this line hits the y axis (from y = mx + c)
+        intercept = theBoid->oldPos[y] - (grad * theBoid->oldPos[x]);
+        
+        /* compare the horizontal position of the neighbor boid with */
+        /* the point on the line that has its vertical coordinate */
+        if (neighbor->oldPos[x] >= ((neighbor->oldPos[y] - intercept) / grad)) {
+            /* return true if the first boid's horizontal movement is +ve */
+            result = (theBoid->oldDir[x] > 0);
+            
+            if (result==0) return 0;
+            else goto next;
+            
+        } else {
+            /* return true if the first boid's horizontal movement is +ve */
+            result = (theBoid->oldDir[x] < 0);
+            if (result==0) return 0;
+            else goto next;
+        }
+    }
+    /* else theBoid is travelling vertically, so just compare vertical coordinates */
+    else if (theBoid->oldDir[y] > 0) {
+        result = (neighbor->oldPos[y] > theBoid->oldPos[y]);
+        if (result==0){
+            return 0;
+        }else{
+            goto next;
+        }
+    }else{
+        result = (neighbor->oldPos[y] < theBoid->oldPos[y]);
+        if (result==0){
+            return 0;
+        } else {
+            goto next;
+        }
+    }
+next:
+    
+    // yz plane
+    
+    // if theBoid is not travelling vertically...
+    if (theBoid->oldDir[y] != 0) {
+        // calculate gradient of a line _perpendicular_ to its direction (hence the minus)
+        grad = -theBoid->oldDir[z] / theBoid->oldDir[y];
+        
+        // calculate where this line hits the y axis (from y = mx + c)
+        intercept = theBoid->oldPos[z] - (grad * theBoid->oldPos[y]);
+        
+        // compare the horizontal position of the neighbor boid with
+        // the point on the line that has its vertical coordinate
+        if (neighbor->oldPos[y] >= ((neighbor->oldPos[z] - intercept) / grad)) {
+            // return true if the first boid's horizontal movement is +ve
+            result = (theBoid->oldDir[y] > 0);
+            if (result==0){
+                return 0;
+            }else{
+                goto next2;
+            }
+        } else {
+            // return true if the first boid's horizontal movement is +ve
+            result = (theBoid->oldDir[y] < 0);
+            if (result==0){
+                return 0;
+            }else{
+                goto next2;
+            }
+        }
+    }
+    // else theBoid is travelling vertically, so just compare vertical coordinates
+    else if (theBoid->oldDir[z] > 0) {
+        result = (neighbor->oldPos[z] > theBoid->oldPos[z]);
+        if (result==0){
+            return 0;
+        }else{
+            goto next2;
+        }
+    }else{
+        result = (neighbor->oldPos[z] < theBoid->oldPos[z]);
+        if (result==0){
+            return 0;
+        }else{
+            goto next2;
+        }
+    }
+next2:
+    return 1;
+}
+
+void NormalizeVelocity(double *direction)
+{
+    float	hypot;
+    
+    hypot = jit_math_sqrt(direction[x] * direction[x] + direction[y] * direction[y] + direction[z] * direction[z] );
+    
+    if (hypot != 0.0) {
+        direction[x] = direction[x] / hypot;
+        direction[y] = direction[y] / hypot;
+        direction[z] = direction[z] / hypot;
+    }
+}
+
+
+/*!
+    @brief Computes the position of a boid between its last two steps
+    @param theBoid The boid
+    @param alpha 0 = oldPos, 1 = newPos
+    @param pos The position is stored here
+ */
+void InterpolatePos(BoidPtr theBoid, double alpha, double *pos)
+{
+    if(alpha >= 1.0){ //exactly newPos, the common case
+        pos[x] = theBoid->newPos[x];
+        pos[y] = theBoid->newPos[y];
+        pos[z] = theBoid->newPos[z];
+        return;
+    }
+    
+    pos[x] = theBoid->oldPos[x] + alpha * (theBoid->newPos[x] - theBoid->oldPos[x]);
+    pos[y] = theBoid->oldPos[y] + alpha * (theBoid->newPos[y] - theBoid->oldPos[y]);
+    pos[z] = theBoid->oldPos[z] + alpha * (theBoid->newPos[z] - theBoid->oldPos[z]);
+}
+
+
+/*!
+    @brief Returns a random integer in the specified range
+ */
+double RandomInt(double minRange, double maxRange)
+{
+    double	t, result;
+    
+    t = (double)(jit_rand() & 0x0000FFFF)/(double)(0x0000FFFF);
+    
+    result = (t * (maxRange - minRange)) + minRange;
+    return(result);
+}
+
+
+/*!
+    @brief Returns the squared distance between 2 points
+ */
+double DistSqrToPt(double *firstPoint, double *secondPoint)
+{
+    double	a, b,c;
+    a = firstPoint[x] - secondPoint[x];
+    b = firstPoint[y] - secondPoint[y];
+    c = firstPoint[z] - secondPoint[z];
+    return(a * a + b * b + c * c);
+}
+
+
+//
+//
+//      MARK: Frame timing
+//
+//
+
+/*!
+    @brief Returns the start time of a phase, or 0 when profiling and tracing are off
+    @discussion systimer_gettime() reads the CPU clock, so the cost is only paid while profiling or tracing
+ */
+double ProfileBegin(t_jit_boids3d *flockPtr)
+{
+    return (flockPtr->profiling || flockPtr->tracing) ? systimer_gettime() : 0.0;
+}
+
+
+/*!
+    @brief Adds the time since start to a phase of the current frame
+    @param phase one of the kProfile constants
+    @param start the value returned by ProfileBegin()
+ */
+void ProfileEnd(t_jit_boids3d *flockPtr, int phase, double start)
+{
+    if(flockPtr->profiling || flockPtr->tracing){
+        flockPtr->phaseTime[phase] += systimer_gettime() - start;
+    }
+}
+
+
+/*!
+    @brief Returns the start time of a per-boid phase, or 0 unless the current boid is a timed sample
+ */
+double ProfileSampleBegin(t_jit_boids3d *flockPtr)
+{
+    return flockPtr->profileSample ? ProfileBegin(flockPtr) : 0.0;
+}
+
+
+/*!
+    @brief Adds the time since start to a per-boid phase of the sampled boids
+    @param phase one of the kProfile constants
+    @param start the value returned by ProfileSampleBegin()
+ */
+void ProfileSampleEnd(t_jit_boids3d *flockPtr, int phase, double start)
+{
+    if(flockPtr->profileSample && (flockPtr->profiling || flockPtr->tracing)){
+        flockPtr->sampleTime[phase] += systimer_gettime() - start;
+    }
+}
+
+
+/*!
+    @brief Splits the time of the whole boid loop between the phases in the proportions the sampled boids spent in them
+    @param loopStart the value returned by ProfileBegin() before the loop
+ */
+void ProfileSampleCommit(t_jit_boids3d *flockPtr, double loopStart)
+{
+    if(!flockPtr->profiling && !flockPtr->tracing){
+        return;
+    }
+    
+    double loopTime = systimer_gettime() - loopStart;
+    double sampled = 0.0;
+    for(int i=0; i<kNumProfilePhases; i++){
+        sampled += flockPtr->sampleTime[i];
+    }
+    if(sampled <= 0.0){
+        return;
+    }
+    
+    for(int i=0; i<kNumProfilePhases; i++){
+        flockPtr->phaseTime[i] += loopTime * flockPtr->sampleTime[i] / sampled;
+    }
+}
+
+
+/*!
+    @brief Moves the phase times of the current frame into the rolling history (and the trace) and starts a new frame
+ */
+void ProfileCommitFrame(t_jit_boids3d *flockPtr)
+{
+    TraceCounters(flockPtr);
+    
+    if(flockPtr->profiling){
+        long slot = flockPtr->profileFrames % kProfileWindow;
+        for(int i=0; i<kNumProfilePhases; i++){
+            flockPtr->phaseHistory[i][slot] = flockPtr->phaseTime[i];
+        }
+        flockPtr->profileFrames++;
+    }
+    
+    for(int i=0; i<kNumProfilePhases; i++){
+        flockPtr->phaseTime[i] = 0.0;
+    }
+}
+
+
+static int CompareDoubles(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+
+/*!
+    @brief Computes the rolling mean and the 95th/99th percentiles of a phase
+    @param phase one of the kProfile constants
+    @discussion Percentiles use the nearest-rank method over the frames in the history window
+ */
+void ProfileSummary(t_jit_boids3d *flockPtr, int phase, double *mean, double *p95, double *p99)
+{
+    double sorted[kProfileWindow];
+    long count = MIN(flockPtr->profileFrames, kProfileWindow);
+    double total = 0;
+    
+    if(count <= 0){
+        *mean = *p95 = *p99 = 0.0;
+        return;
+    }
+    
+    for(long i=0; i<count; i++){
+        sorted[i] = flockPtr->phaseHistory[phase][i];
+        total += sorted[i];
+    }
+    qsort(sorted, count, sizeof(double), CompareDoubles);
+    
+    *mean = total/count;
+    *p95 = sorted[(long)ceil(0.95*count) - 1];
+    *p99 = sorted[(long)ceil(0.99*count) - 1];
+}
+
+
+/*!
+    @brief Writes the last, mean, p95 and p99 time of every phase, as output in the 5th outlet
+    @param data kNumProfilePhases*4 floats, all 0 while profiling is off
+ */
+void ProfileFillTiming(t_jit_boids3d *flockPtr, float *data)
+{
+    for(int i=0; i<kNumProfilePhases; i++){
+        double mean = 0, p95 = 0, p99 = 0, last = 0;
+        if(flockPtr->profiling && flockPtr->profileFrames > 0){
+            last = flockPtr->phaseHistory[i][(flockPtr->profileFrames-1) % kProfileWindow];
+            ProfileSummary(flockPtr, i, &mean, &p95, &p99);
+        }
+        data[0] = last;
+        data[1] = mean;
+        data[2] = p95;
+        data[3] = p99;
+        
+        data += 4; //planecount
+    }
+}
+
+
+//
+//
+//      MARK: Asynchronous simulation thread
+//
+//
+
+/*
+ The simulation thread owns simBack and matrix_calc owns simFront; the third frame sits in simMiddle.
+ Publishing swaps the back frame into the middle, acquiring swaps the middle frame to the front when
+ it is fresh, so neither side ever waits on the other.
+ */
+
+
+/*!
+    @brief Starts the simulation thread, allocating the frames the first time
+    @param flockPtr A pointer to the flocks object
+    @discussion The current state is packed into the front frame so the output has something to show before the first step
+ */
+void SimStart(t_jit_boids3d *flockPtr)
+{
+    if(flockPtr->simThread){
+        return;
+    }
+    
+    for(int i=0; i<3; i++){
+        if(!flockPtr->simFrames[i]){
+            flockPtr->simFrames[i] = (SimFramePtr)calloc(1, sizeof(SimFrame));
+            if(flockPtr->simFrames[i]){
+                flockPtr->simFrames[i]->index = i;
+            }
+        }
+        if(!flockPtr->simFrames[i]){
+            post("ERROR: failed to allocate the simulation frames");
+            return;
+        }
+    }
+    
+    systhread_mutex_lock(flockPtr->simLock);
+    flockPtr->stepAlpha = 1.0; //the thread outputs whole steps
+    SimPackFrame(flockPtr, flockPtr->simFrames[2]);
+    ProfileFillTiming(flockPtr, flockPtr->simFrames[2]->timing[0]);
+    flockPtr->simBack = 0;
+    flockPtr->simMiddle = 1;
+    flockPtr->simFront = 2;
+    systhread_mutex_unlock(flockPtr->simLock);
+    
+    flockPtr->simQuit = 0;
+    if(systhread_create((method)SimThreadProc, flockPtr, 0, 0, 0, &flockPtr->simThread) != 0){
+        post("ERROR: failed to start the simulation thread");
+        flockPtr->simThread = NULL;
+    }
+}
+
+
+/*!
+    @brief Stops the simulation thread and waits for it to return
+    @param flockPtr A pointer to the flocks object
+    @discussion The frames are kept, matrix_calc may still be reading the front one
+ */
+void SimStop(t_jit_boids3d *flockPtr)
+{
+    unsigned int ret;
+    
+    if(!flockPtr->simThread){
+        return;
+    }
+    
+    flockPtr->simQuit = 1;
+    systhread_join(flockPtr->simThread, &ret);
+    flockPtr->simThread = NULL;
+}
+
+
+/*!
+    @brief Body of the simulation thread: steps, packs and publishes a frame simRate times per second until simQuit is set
+    @param flockPtr A pointer to the flocks object
+ */
+void *SimThreadProc(t_jit_boids3d *flockPtr)
+{
+    while(!flockPtr->simQuit){
+        
+        //a warm-up is stepping instead
+        if(flockPtr->warming){
+            systhread_sleep(1);
+            continue;
+        }
+        
+        double stepStart = systimer_gettime();
+        
+        //the step and the packing are timed as one frame
+        systhread_mutex_lock(flockPtr->simLock);
+        double frameStart = ProfileBegin(flockPtr);
+        TraceRecord(flockPtr, "sim step", 'B');
+        FlightStep(flockPtr, 1);
+        
+        SimFramePtr frame = flockPtr->simFrames[flockPtr->simBack];
+        double packingStart = ProfileBegin(flockPtr);
+        SimPackFrame(flockPtr, frame);
+        ProfileEnd(flockPtr, kProfilePacking, packingStart);
+        ProfileEnd(flockPtr, kProfileTotal, frameStart);
+        ProfileCommitFrame(flockPtr);
+        ProfileFillTiming(flockPtr, frame->timing[0]);
+        TraceRecord(flockPtr, "sim step", 'E');
+        systhread_mutex_unlock(flockPtr->simLock);
+        
+        SimPublish(flockPtr);
+        
+        //sleep for the rest of the period, and at least 1 ms so an overrunning step doesn't spin a core
+        double wait = 1000.0/flockPtr->simRate - (systimer_gettime() - stepStart);
+        systhread_sleep(MAX((long)wait, 1));
+    }
+    
+    systhread_exit(0);
+    return NULL;
+}
+
+
+/*!
+    @brief Packs the current state of the simulation into a frame for the 1st, 2nd, 4th and 6th to 12th outlets
+           and the attractor statistics of the 3rd
+    @param flockPtr A pointer to the flocks object
+    @param frame The frame that is written
+ */
+void SimPackFrame(t_jit_boids3d *flockPtr, SimFramePtr frame)
+{
+    long dim[JIT_MATRIX_MAX_DIMCOUNT];
+    
+    frame->planecount = OutputPlanecount(flockPtr);
+    
+    frame->numBoids = PackOrder(flockPtr); //before the lines are copied, it finds their rows
+    memcpy(frame->flockRanges, flockPtr->flockRanges, sizeof(frame->flockRanges));
+    if(frame->queryVersion != flockPtr->queryVersion){
+        frame->queryCount = flockPtr->queryCount;
+        memcpy(frame->queryResult, flockPtr->queryResult, frame->queryCount*sizeof(frame->queryResult[0]));
+        frame->queryVersion = flockPtr->queryVersion;
+    }
+    dim[0] = frame->numBoids;
+    dim[1] = 1;
+    jit_boids3d_calculate_ndim(flockPtr, 2, dim, frame->planecount, NULL, (char *)frame->boids);
+    
+    memcpy(frame->boidCount, flockPtr->boidCount, sizeof(frame->boidCount));
+    frame->countsVersion = flockPtr->countsVersion;
+    
+    frame->numLines = flockPtr->sizeOfNeighborhoodConnections;
+    for(int i=0; i<frame->numLines; i++){
+        frame->lines[i] = *flockPtr->neighborhoodConnections[i];
+    }
+    
+    if(flockPtr->histogramming){
+        memcpy(frame->neighborHistogram, flockPtr->neighborHistogram, sizeof(frame->neighborHistogram));
+        memcpy(frame->candidateHistogram, flockPtr->candidateHistogram, sizeof(frame->candidateHistogram));
+    }
+    
+    if(flockPtr->flockStatsOn){
+        memcpy(frame->flockStats, flockPtr->flockStats, sizeof(frame->flockStats));
+    }
+    
+    for(AttractorPtr attractor = flockPtr->attractorLL; flockPtr->attractorStatsOn && attractor; attractor = attractor->nextAttractor){
+        attractor->frameStats[frame->index] = attractor->stats;
+    }
+    
+    if(flockPtr->clustering){
+        frame->numClusters = flockPtr->numClusters;
+        memcpy(frame->clusterSummary, flockPtr->clusterSummary, flockPtr->numClusters*kClusterPlanes*sizeof(float));
+    }
+    
+    frame->densitySize = flockPtr->densitySize;
+    if(frame->densitySize > 0 && !frame->density){
+        frame->density = (float *)malloc(kMaxDensityVoxels*sizeof(float));
+        if(!frame->density){
+            post("ERROR: failed to allocate the density grid of a simulation frame");
+            frame->densitySize = 0;
+        }
+    }
+    if(frame->densitySize > 0){
+        memcpy(frame->density, flockPtr->density, frame->densitySize*frame->densitySize*frame->densitySize*sizeof(float));
+    }
+    
+    frame->trailLength = flockPtr->trailLength;
+    frame->trailBoids = frame->numBoids;
+    long trailFloats = frame->trailLength*frame->trailBoids*3;
+    if(trailFloats > frame->trailCapacity){
+        float *trail = (float *)realloc(frame->trail, trailFloats*sizeof(float));
+        if(trail){
+            frame->trail = trail;
+            frame->trailCapacity = trailFloats;
+        }else{
+            post("ERROR: failed to allocate the trails of a simulation frame");
+            frame->trailLength = 0;
+        }
+    }
+    if(frame->trailLength > 0){
+        TrailPack(flockPtr, (char *)frame->trail, frame->trailBoids*3*sizeof(float));
+    }
+}
+
+
+/*!
+    @brief Hands the back frame to the output and takes the middle one to pack the next step into
+    @param flockPtr A pointer to the flocks object
+ */
+void SimPublish(t_jit_boids3d *flockPtr)
+{
+    int32_t middle;
+    
+    do{
+        middle = flockPtr->simMiddle;
+    }while(!ATOMIC_COMPARE_SWAP32(middle, flockPtr->simBack | kSimFresh, &flockPtr->simMiddle));
+    
+    flockPtr->simBack = middle & ~kSimFresh;
+}
+
+
+/*!
+    @brief Returns the last frame the simulation thread published, never waits
+    @param flockPtr A pointer to the flocks object
+    @return The front frame, which stays valid until the next call
+ */
+SimFramePtr SimAcquire(t_jit_boids3d *flockPtr)
+{
+    int32_t middle = flockPtr->simMiddle;
+    
+    //take the fresh frame and give the old front frame back to the simulation thread
+    if(middle & kSimFresh){
+        do{
+            middle = flockPtr->simMiddle;
+        }while(!ATOMIC_COMPARE_SWAP32(middle, flockPtr->simFront, &flockPtr->simMiddle));
+        
+        flockPtr->simFront = middle & ~kSimFresh;
+    }
+    
+    return flockPtr->simFrames[flockPtr->simFront];
+}
+
+
+//
+//
+//      MARK: Per-flock statistics
+//
+//
+
+
+/*!
+    @brief Empties the sums of a flock before a step
+ */
+void FlockStatsClear(FlockStats *stats)
+{
+    memset(stats, 0, sizeof(FlockStats));
+    for(int i=0; i<3; i++){
+        stats->min[i] = DBL_MAX;
+        stats->max[i] = -DBL_MAX;
+    }
+}
+
+
+/*!
+    @brief Adds a boid whose step is finished to the sums of its flock
+    @param stats The sums of the flock
+    @param theBoid The boid, newPos and newDir are final
+ */
+void FlockStatsAdd(FlockStats *stats, BoidPtr theBoid)
+{
+    double vel[3];
+    double *pos = theBoid->newPos;
+    
+    vel[x] = theBoid->newPos[x] - theBoid->oldPos[x];
+    vel[y] = theBoid->newPos[y] - theBoid->oldPos[y];
+    vel[z] = theBoid->newPos[z] - theBoid->oldPos[z];
+    
+    stats->count++;
+    for(int i=0; i<3; i++){
+        stats->posSum[i] += pos[i];
+        stats->posSqrSum[i] += pos[i]*pos[i];
+        stats->min[i] = MIN(stats->min[i], pos[i]);
+        stats->max[i] = MAX(stats->max[i], pos[i]);
+        stats->dirSum[i] += theBoid->newDir[i];
+        stats->velSum[i] += vel[i];
+    }
+    stats->speedSum += jit_math_sqrt(vel[x]*vel[x] + vel[y]*vel[y] + vel[z]*vel[z]);
+    
+    stats->posCrossVelSum[x] += pos[y]*vel[z] - pos[z]*vel[y];
+    stats->posCrossVelSum[y] += pos[z]*vel[x] - pos[x]*vel[z];
+    stats->posCrossVelSum[z] += pos[x]*vel[y] - pos[y]*vel[x];
+}
+
+
+/*!
+    @brief Turns the sums of a flock into a row of the 8th outlet
+    @param stats The sums of the flock
+    @param out kFlockStatsPlanes floats: centroid, variance, bounding box min and max, mean speed,
+               polarization (length of the mean heading, 1 = all aligned) and the mean angular momentum
+               about the centroid, per boid and per step; all 0 for an empty flock
+ */
+void FlockStatsFill(FlockStats *stats, float *out)
+{
+    double c[3], meanVel[3], momentum[3];
+    
+    if(stats->count <= 0){
+        memset(out, 0, kFlockStatsPlanes*sizeof(float));
+        return;
+    }
+    
+    for(int i=0; i<3; i++){
+        c[i] = stats->posSum[i]/stats->count;
+        meanVel[i] = stats->velSum[i]/stats->count;
+        out[i] = c[i];
+        out[3+i] = MAX(stats->posSqrSum[i]/stats->count - c[i]*c[i], 0.0);
+        out[6+i] = stats->min[i];
+        out[9+i] = stats->max[i];
+    }
+    out[12] = stats->speedSum/stats->count;
+    out[13] = jit_math_sqrt(stats->dirSum[x]*stats->dirSum[x] + stats->dirSum[y]*stats->dirSum[y] +
+                            stats->dirSum[z]*stats->dirSum[z])/stats->count;
+    
+    //sum of (pos - c) x vel = sum of pos x vel - c x sum of vel
+    momentum[x] = stats->posCrossVelSum[x]/stats->count - (c[y]*meanVel[z] - c[z]*meanVel[y]);
+    momentum[y] = stats->posCrossVelSum[y]/stats->count - (c[z]*meanVel[x] - c[x]*meanVel[z]);
+    momentum[z] = stats->posCrossVelSum[z]/stats->count - (c[x]*meanVel[y] - c[y]*meanVel[x]);
+    out[14] = momentum[x];
+    out[15] = momentum[y];
+    out[16] = momentum[z];
+}
+
+
+//
+//
+//      MARK: Attractor statistics
+//
+//
+
+
+/*!
+    @brief Empties the statistics of one attractor
+ */
+void AttractorStatsClear(AttractorStats *stats)
+{
+    memset(stats, 0, sizeof(AttractorStats));
+    stats->nearestDist = DBL_MAX;
+    stats->nearestID = -1;
+}
+
+
+/*!
+    @brief Adds a boid to the statistics of one attractor
+    @param stats The statistics of the attractor
+    @param theBoid The boid, at the distance dist from the attractor
+    @param radius The attraction radius of the attractor
+ */
+void AttractorStatsAdd(AttractorStats *stats, BoidPtr theBoid, double dist, double radius)
+{
+    if(dist < radius){
+        stats->count[theBoid->flockID]++;
+        stats->distSum[theBoid->flockID] += dist;
+    }
+    
+    if(dist < stats->nearestDist){
+        stats->nearestDist = dist;
+        stats->nearestID = theBoid->globalID;
+    }
+}
+
+
+//
+//
+//      MARK: Culling and level of detail
+//
+//
+
+
+/*!
+    @brief Gathers the boids the 1st outlet gets into packBoids, in list order
+    @param flockPtr A pointer to the flocks object
+    @return The number of boids gathered
+    @discussion With cull on, a boid is only gathered if its position is inside the frustum of the camera.
+                The simulation itself always steps every boid. When none is inside, the 1st outlet is
+                a single row of zeros, so a scale or color field hides it.
+ */
+long PackGather(t_jit_boids3d *flockPtr)
+{
+    double pos[3];
+    
+    //right, up and forward of the camera, up as close to +y as the view direction allows
+    if(flockPtr->culling){
+        double *forward = flockPtr->viewBasis[2];
+        double *side = flockPtr->viewBasis[0];
+        double *up = flockPtr->viewBasis[1];
+        double worldUp[3] = {0.0, 1.0, 0.0};
+        
+        forward[x] = flockPtr->camera[3];
+        forward[y] = flockPtr->camera[4];
+        forward[z] = flockPtr->camera[5];
+        NormalizeVelocity(forward);
+        if(fabs(forward[y]) > 0.999){
+            worldUp[y] = 0.0;
+            worldUp[z] = 1.0;
+        }
+        
+        side[x] = forward[y]*worldUp[z] - forward[z]*worldUp[y];
+        side[y] = forward[z]*worldUp[x] - forward[x]*worldUp[z];
+        side[z] = forward[x]*worldUp[y] - forward[y]*worldUp[x];
+        NormalizeVelocity(side);
+        
+        up[x] = side[y]*forward[z] - side[z]*forward[y];
+        up[y] = side[z]*forward[x] - side[x]*forward[z];
+        up[z] = side[x]*forward[y] - side[y]*forward[x];
+    }
+    
+    flockPtr->packCount = 0;
+    for (int i=0; i<MAX_FLOCKS; i++){
+        BoidPtr iterator = flockPtr->flockLL[i];
+        
+        while (iterator && flockPtr->packCount < kMaxNumBoids){
+            if(flockPtr->culling){
+                InterpolatePos(iterator, flockPtr->stepAlpha, pos);
+                if(!InFrustum(flockPtr, pos)){
+                    iterator->packRow = -1;
+                    iterator = iterator->nextBoid;
+                    continue;
+                }
+            }
+            flockPtr->packBoids[flockPtr->packCount++] = iterator;
+            iterator = iterator->nextBoid;
+        }
+    }
+    
+    return flockPtr->packCount;
+}
+
+
+/*!
+    @brief Puts the boids of the 1st outlet into packBoids in the order of its rows
+    @param flockPtr A pointer to the flocks object
+    @return The number of rows
+    @discussion Gathers them, records the range of rows of each flock (7th outlet), sorts them back to
+                front when depthsort is on, finds the rows of the ends of the neighbor lines in this
+                order and answers a waiting query. Called once for every output, before the outlets are sized.
+ */
+long PackOrder(t_jit_boids3d *flockPtr)
+{
+    long counts[MAX_FLOCKS] = {0};
+    long offset = 0;
+    
+    PackGather(flockPtr);
+    
+    //the flocks are contiguous in flock order as gathered
+    for(long i=0; i<flockPtr->packCount; i++){
+        counts[flockPtr->packBoids[i]->flockID]++;
+    }
+    for(int i=0; i<MAX_FLOCKS; i++){
+        flockPtr->flockRanges[i][0] = flockPtr->depthSort ? -1 : offset;
+        flockPtr->flockRanges[i][1] = flockPtr->depthSort ? -1 : counts[i];
+        offset += counts[i];
+    }
+    
+    //back to front for the camera instead
+    if(flockPtr->depthSort){
+        DepthSort(flockPtr);
+    }
+    
+    //where the ends of the lines are in the 1st outlet
+    if(flockPtr->lineOutput && flockPtr->sizeOfNeighborhoodConnections > 0){
+        LineIndexUpdate(flockPtr);
+    }
+    
+    //rows for the query
+    for(long i=0; i<flockPtr->packCount; i++){
+        flockPtr->packBoids[i]->packRow = i;
+    }
+    if(flockPtr->queryKind != kQueryNone){
+        QueryRun(flockPtr);
+    }
+    
+    return flockPtr->packCount;
+}
+
+
+/*!
+    @brief Answers the query waiting for this output, for the 12th outlet
+    @param flockPtr A pointer to the flocks object
+    @discussion Measures to the positions the 1st outlet gets and reports the rows PackOrder gave the boids.
+                query_knn keeps the k nearest in a max-heap, so a boid only has to beat the farthest of them,
+                and sorts them once at the end.
+ */
+void QueryRun(t_jit_boids3d *flockPtr)
+{
+    double *point = flockPtr->queryArgs;
+    double radius = point[3];
+    long k = CLAMP((long)point[3], 0, kMaxNumBoids);
+    char knn = flockPtr->queryKind == kQueryKNN;
+    long count = 0;
+    long index = 0;
+    double pos[3];
+    
+    for(int i=0; i<MAX_FLOCKS; i++){
+        for(BoidPtr iterator = flockPtr->flockLL[i]; iterator && index < kMaxNumBoids; iterator = iterator->nextBoid, index++){
+            InterpolatePos(iterator, flockPtr->stepAlpha, pos);
+            float row[3] = {iterator->packRow, iterator->globalID, sqrt(DistSqrToPt(point, pos))};
+            
+            if(knn){
+                count = QueryHeapAdd(flockPtr->queryResult, count, k, row);
+            }else if(row[2] <= radius){
+                memcpy(flockPtr->queryResult[count++], row, sizeof(row));
+            }
+        }
+    }
+    qsort(flockPtr->queryResult, count, sizeof(flockPtr->queryResult[0]), CompareQueryRows);
+    
+    flockPtr->queryCount = count;
+    flockPtr->queryKind = kQueryNone;
+    flockPtr->queryVersion++;
+}
+
+
+/*!
+    @brief Adds a row to the max-heap of the k nearest found so far, the farthest on top
+    @param heap Rows of the heap
+    @param count Rows in the heap
+    @param k Rows the heap holds at most
+    @param row Row, globalID, distance
+    @return The rows in the heap now
+    @discussion Until the heap is full a row rises from the bottom, then a row nearer than the top replaces it and sinks
+ */
+long QueryHeapAdd(float (*heap)[3], long count, long k, const float *row)
+{
+    long slot;
+    
+    if(count < k){
+        slot = count++;
+        while(slot > 0 && heap[(slot-1)/2][2] < row[2]){
+            memcpy(heap[slot], heap[(slot-1)/2], sizeof(heap[0]));
+            slot = (slot-1)/2;
+        }
+    }else if(k > 0 && row[2] < heap[0][2]){
+        slot = 0;
+        while(2*slot+1 < count){
+            long child = 2*slot+1;
+            if(child+1 < count && heap[child+1][2] > heap[child][2]){
+                child++;
+            }
+            if(heap[child][2] <= row[2]){
+                break;
+            }
+            memcpy(heap[slot], heap[child], sizeof(heap[0]));
+            slot = child;
+        }
+    }else{
+        return count;
+    }
+    
+    memcpy(heap[slot], row, sizeof(heap[0]));
+    return count;
+}
+
+
+/*!
+    @brief Determines if a point is inside the frustum of the camera, as gathered by PackGather
+    @return 0 if the point is outside, 1 if it is inside
+    @discussion The point is the center of the boid, a boid half across the edge of the view is left out
+ */
+char InFrustum(t_jit_boids3d *flockPtr, double *pos)
+{
+    double toPos[3] = {pos[x] - flockPtr->camera[0], pos[y] - flockPtr->camera[1], pos[z] - flockPtr->camera[2]};
+    double (*basis)[3] = flockPtr->viewBasis;
+    
+    double depth = toPos[x]*basis[2][x] + toPos[y]*basis[2][y] + toPos[z]*basis[2][z];
+    if(depth < flockPtr->frustum[2] || depth > flockPtr->frustum[3]){
+        return 0;
+    }
+    
+    double halfHeight = depth * tan(0.5 * flockPtr->frustum[0] * flockPtr->d2r);
+    double halfWidth = halfHeight * flockPtr->frustum[1];
+    double across = toPos[x]*basis[0][x] + toPos[y]*basis[0][y] + toPos[z]*basis[0][z];
+    double above = toPos[x]*basis[1][x] + toPos[y]*basis[1][y] + toPos[z]*basis[1][z];
+    
+    return fabs(across) <= halfWidth && fabs(above) <= halfHeight;
+}
+
+
+/*!
+    @brief Returns the level of detail of a position for the lod field
+    @return 0 closer to the camera than the first lod distance, up to lodCount beyond the last
+ */
+int BoidLOD(t_jit_boids3d *flockPtr, double *pos)
+{
+    double camera[3] = {flockPtr->camera[0], flockPtr->camera[1], flockPtr->camera[2]};
+    double dist = sqrt(DistSqrToPt(camera, pos));
+    int level = 0;
+    
+    while(level < flockPtr->lodCount && dist >= flockPtr->lodDistances[level]){
+        level++;
+    }
+    return level;
+}
+
+
+//
+//
+//      MARK: Depth sorting
+//
+//
+
+
+/*!
+    @brief Orders packBoids from the farthest to the nearest along the view direction of the camera
+    @param flockPtr A pointer to the flocks object
+    @discussion The depths are quantized to 16 bit keys over the range of this frame and sorted with
+                2 passes of a stable LSD radix sort, so boids at the same depth keep the list order.
+                Each pass counts the digits of kDepthSortChunks slices of the boids, turns the counts
+                into the offset each slice scatters to, and scatters the slices. The counting and the
+                scattering run in parallel from kParallelPackBoids boids.
+ */
+void DepthSort(t_jit_boids3d *flockPtr)
+{
+    t_jit_matrix_info minfo;
+    long dim[2];
+    long count = flockPtr->packCount;
+    double depth[kMaxNumBoids];
+    double nearest = DBL_MAX, farthest = -DBL_MAX;
+    
+    //the depths of the positions the 1st outlet gets
+    for(long i=0; i<count; i++){
+        double pos[3];
+        InterpolatePos(flockPtr->packBoids[i], flockPtr->stepAlpha, pos);
+        depth[i] = (pos[x] - flockPtr->camera[0]) * flockPtr->camera[3] +
+                   (pos[y] - flockPtr->camera[1]) * flockPtr->camera[4] +
+                   (pos[z] - flockPtr->camera[2]) * flockPtr->camera[5];
+        nearest = MIN(nearest, depth[i]);
+        farthest = MAX(farthest, depth[i]);
+    }
+    if(count < 2 || farthest <= nearest){
+        return;
+    }
+    
+    //0 for the farthest boid
+    double scale = 65535.0 / (farthest - nearest);
+    for(long i=0; i<count; i++){
+        flockPtr->sortKeys[0][i] = (unsigned short)((farthest - depth[i]) * scale);
+    }
+    
+    //one row per slice
+    memset(&minfo, 0, sizeof(minfo));
+    minfo.type = _jit_sym_long;
+    minfo.planecount = 1;
+    minfo.dimcount = 2;
+    minfo.dim[0] = dim[0] = kDepthSortRadix;
+    minfo.dim[1] = dim[1] = kDepthSortChunks;
+    minfo.dimstride[0] = sizeof(long);
+    minfo.dimstride[1] = sizeof(flockPtr->sortOffsets[0]);
+    
+    for(flockPtr->sortShift = 0; flockPtr->sortShift < 16; flockPtr->sortShift += 8){
+        
+        if(count < kParallelPackBoids){
+            jit_boids3d_sort_count(flockPtr, 2, dim, 1, &minfo, (char *)flockPtr->sortOffsets);
+        }else{
+            jit_parallel_ndim_simplecalc1((method)jit_boids3d_sort_count, flockPtr, 2, dim, 1, &minfo, (char *)flockPtr->sortOffsets, 0);
+        }
+        
+        //digit by digit, slice by slice, so that the sort is stable
+        long offset = 0;
+        for(int d=0; d<kDepthSortRadix; d++){
+            for(int c=0; c<kDepthSortChunks; c++){
+                long digits = flockPtr->sortOffsets[c][d];
+                flockPtr->sortOffsets[c][d] = offset;
+                offset += digits;
+            }
+        }
+        
+        if(count < kParallelPackBoids){
+            jit_boids3d_sort_scatter(flockPtr, 2, dim, 1, &minfo, (char *)flockPtr->sortOffsets);
+        }else{
+            jit_parallel_ndim_simplecalc1((method)jit_boids3d_sort_scatter, flockPtr, 2, dim, 1, &minfo, (char *)flockPtr->sortOffsets, 0);
+        }
+        
+        //the scattered boids are the input of the next pass
+        memcpy(flockPtr->packBoids, flockPtr->sortBoids, count*sizeof(BoidPtr));
+        memcpy(flockPtr->sortKeys[0], flockPtr->sortKeys[1], count*sizeof(unsigned short));
+    }
+}
+
+/*
+ Counts the digits of the slices of the boids a worker of DepthSort was given
+ */
+void jit_boids3d_sort_count(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                            t_jit_matrix_info *minfo, char *bop)
+{
+    long firstChunk = (bop - (char *)flockPtr->sortOffsets) / minfo->dimstride[1];
+    
+    for(long j=0; j<dim[1]; j++){
+        long chunk = firstChunk + j;
+        long *counts = flockPtr->sortOffsets[chunk];
+        long first = chunk * flockPtr->packCount / kDepthSortChunks;
+        long last = (chunk + 1) * flockPtr->packCount / kDepthSortChunks;
+        
+        memset(counts, 0, kDepthSortRadix*sizeof(long));
+        for(long i=first; i<last; i++){
+            counts[(flockPtr->sortKeys[0][i] >> flockPtr->sortShift) & (kDepthSortRadix-1)]++;
+        }
+    }
+}
+
+/*
+ Scatters the slices of the boids a worker of DepthSort was given to the offsets of their digits
+ */
+void jit_boids3d_sort_scatter(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                              t_jit_matrix_info *minfo, char *bop)
+{
+    long firstChunk = (bop - (char *)flockPtr->sortOffsets) / minfo->dimstride[1];
+    
+    for(long j=0; j<dim[1]; j++){
+        long chunk = firstChunk + j;
+        long *offsets = flockPtr->sortOffsets[chunk];
+        long first = chunk * flockPtr->packCount / kDepthSortChunks;
+        long last = (chunk + 1) * flockPtr->packCount / kDepthSortChunks;
+        
+        for(long i=first; i<last; i++){
+            unsigned short key = flockPtr->sortKeys[0][i];
+            long to = offsets[(key >> flockPtr->sortShift) & (kDepthSortRadix-1)]++;
+            flockPtr->sortBoids[to] = flockPtr->packBoids[i];
+            flockPtr->sortKeys[1][to] = key;
+        }
+    }
+}
+
+
+//
+//
+//      MARK: Density grid
+//
+//
+
+
+/*!
+    @brief Splats the boids of the step into the density grid of the 10th outlet
+    @param flockPtr A pointer to the flocks object
+    @discussion The grid spans the flyrect. Few boids are splatted straight into it. Otherwise the boids
+                are cut into kDensityPartials slices, the workers splat each slice into a grid of its own
+                without sharing a voxel, and a second parallel pass sums the grids slab by slab.
+ */
+void DensityUpdate(t_jit_boids3d *flockPtr)
+{
+    t_jit_matrix_info minfo;
+    long dim[2];
+    long size = flockPtr->densitySize;
+    long voxels = size*size*size;
+    
+    //x left to right, y bottom to top, z back to front
+    double lo[3] = {flockPtr->flyrect[left], flockPtr->flyrect[bottom], flockPtr->flyrect[back]};
+    double hi[3] = {flockPtr->flyrect[right], flockPtr->flyrect[top], flockPtr->flyrect[front]};
+    for(int i=0; i<3; i++){
+        double extent = (hi[i] - lo[i]) * kFlyRectScalingFactor;
+        flockPtr->densityOrigin[i] = lo[i] * kFlyRectScalingFactor;
+        flockPtr->densityScale[i] = extent != 0.0 ? size / extent : 0.0;
+    }
+    
+    //gather the boids so that slices can be splatted independently
+    flockPtr->densityCount = 0;
+    for(int i=0; i<MAX_FLOCKS; i++){
+        BoidPtr iterator = flockPtr->flockLL[i];
+        while(iterator && flockPtr->densityCount < kMaxNumBoids){
+            flockPtr->densityBoids[flockPtr->densityCount++] = iterator;
+            iterator = iterator->nextBoid;
+        }
+    }
+    
+    if(flockPtr->densityCount < kParallelPackBoids){
+        memset(flockPtr->density, 0, voxels*sizeof(float));
+        for(long i=0; i<flockPtr->densityCount; i++){
+            DensitySplat(flockPtr, flockPtr->densityBoids[i], flockPtr->density);
+        }
+        return;
+    }
+    
+    //one row per partial grid
+    memset(&minfo, 0, sizeof(minfo));
+    minfo.type = _jit_sym_float32;
+    minfo.planecount = 1;
+    minfo.dimcount = 2;
+    minfo.dim[0] = dim[0] = 1;
+    minfo.dim[1] = dim[1] = kDensityPartials;
+    minfo.dimstride[0] = sizeof(float);
+    minfo.dimstride[1] = sizeof(flockPtr->densityPartials[0]);
+    jit_parallel_ndim_simplecalc1((method)jit_boids3d_density_partials, flockPtr, 2, dim, 1, &minfo, (char *)flockPtr->densityPartials, 0);
+    
+    //one row per z slab of the grid
+    minfo.dim[0] = dim[0] = size*size;
+    minfo.dim[1] = dim[1] = size;
+    minfo.dimstride[1] = size*size*sizeof(float);
+    jit_parallel_ndim_simplecalc1((method)jit_boids3d_density_reduce, flockPtr, 2, dim, 1, &minfo, (char *)flockPtr->density, 0);
+}
+
+/*
+ Splats the slices of the boids of the partial grids a worker of DensityUpdate was given
+ */
+void jit_boids3d_density_partials(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                                  t_jit_matrix_info *minfo, char *bop)
+{
+    long firstPartial = (bop - (char *)flockPtr->densityPartials) / minfo->dimstride[1];
+    long voxels = flockPtr->densitySize*flockPtr->densitySize*flockPtr->densitySize;
+    
+    for(long j=0; j<dim[1]; j++){
+        long partial = firstPartial + j;
+        float *grid = flockPtr->densityPartials[partial];
+        long first = partial * flockPtr->densityCount / kDensityPartials;
+        long last = (partial + 1) * flockPtr->densityCount / kDensityPartials;
+        
+        memset(grid, 0, voxels*sizeof(float));
+        for(long i=first; i<last; i++){
+            DensitySplat(flockPtr, flockPtr->densityBoids[i], grid);
+        }
+    }
+}
+
+/*
+ Sums the partial grids into the z slabs of the density grid a worker of DensityUpdate was given
+ */
+void jit_boids3d_density_reduce(t_jit_boids3d *flockPtr, long dimcount, long *dim, long planecount,
+                                t_jit_matrix_info *minfo, char *bop)
+{
+    long first = (bop - (char *)flockPtr->density) / sizeof(float);
+    long last = first + dim[0]*dim[1];
+    
+    for(long v=first; v<last; v++){
+        float sum = 0;
+        for(int p=0; p<kDensityPartials; p++){
+            sum += flockPtr->densityPartials[p][v];
+        }
+        flockPtr->density[v] = sum;
+    }
+}
+
+
+/*!
+    @brief Adds one boid to a density grid, with a total weight of 1 spread over the voxels around it
+    @param flockPtr A pointer to the flocks object
+    @param theBoid The boid, splatted at newPos
+    @param grid densitySize^3 voxels
+    @discussion The kernel is separable: densitykernel 0 is trilinear over the 2 nearest voxel centers of
+                each axis, 1 a gaussian of sigma 1 voxel over 2*kDensityGaussRadius+1 voxels. The weight
+                that falls outside the grid is dropped.
+ */
+void DensitySplat(t_jit_boids3d *flockPtr, BoidPtr theBoid, float *grid)
+{
+    long size = flockPtr->densitySize;
+    long index[3][2*kDensityGaussRadius+1];
+    double weight[3][2*kDensityGaussRadius+1];
+    int taps = flockPtr->densityKernel ? 2*kDensityGaussRadius+1 : 2;
+    
+    for(int a=0; a<3; a++){
+        //in voxels, the centers at whole numbers
+        double u = (theBoid->newPos[a] - flockPtr->densityOrigin[a]) * flockPtr->densityScale[a] - 0.5;
+        
+        if(flockPtr->densityKernel){
+            long center = (long)floor(u + 0.5);
+            double sum = 0;
+            for(int t=0; t<taps; t++){
+                index[a][t] = center - kDensityGaussRadius + t;
+                weight[a][t] = exp(-0.5*(index[a][t] - u)*(index[a][t] - u));
+                sum += weight[a][t];
+            }
+            for(int t=0; t<taps; t++){
+                weight[a][t] /= sum;
+            }
+        }else{
+            index[a][0] = (long)floor(u);
+            index[a][1] = index[a][0] + 1;
+            weight[a][1] = u - index[a][0];
+            weight[a][0] = 1.0 - weight[a][1];
+        }
+    }
+    
+    for(int k=0; k<taps; k++){
+        if(index[z][k] < 0 || index[z][k] >= size){
+            continue;
+        }
+        for(int j=0; j<taps; j++){
+            if(index[y][j] < 0 || index[y][j] >= size){
+                continue;
+            }
+            float *row = grid + (index[z][k]*size + index[y][j])*size;
+            double wyz = weight[z][k] * weight[y][j];
+            for(int i=0; i<taps; i++){
+                if(index[x][i] >= 0 && index[x][i] < size){
+                    row[index[x][i]] += wyz * weight[x][i];
+                }
+            }
+        }
+    }
+}
+
+
+//
+//
+//      MARK: Trails
+//
+//
+
+
+/*!
+    @brief Hands a new boid a ring buffer of the trails
+    @param flockPtr A pointer to the flocks object
+    @return The slot of the ring buffer in trails, -1 if all kMaxNumBoids are taken
+    @discussion Slots are handed out whether the trails are on or not, so that turning them on
+                doesn't have to visit every boid. A dead boid's slot is reused first.
+ */
+int TrailClaim(t_jit_boids3d *flockPtr)
+{
+    if(flockPtr->trailFreeCount > 0){
+        return flockPtr->trailFreeSlots[--flockPtr->trailFreeCount];
+    }
+    if(flockPtr->trailSlotsUsed < kMaxNumBoids){
+        return (int)flockPtr->trailSlotsUsed++;
+    }
+    return -1;
+}
+
+
+/*!
+    @brief Gives the ring buffer of a boid that is about to be freed back to TrailClaim
+    @param flockPtr A pointer to the flocks object
+    @param theBoid The boid
+ */
+void TrailRelease(t_jit_boids3d *flockPtr, BoidPtr theBoid)
+{
+    if(theBoid->trailSlot >= 0 && flockPtr->trailFreeCount < kMaxNumBoids){
+        flockPtr->trailFreeSlots[flockPtr->trailFreeCount++] = theBoid->trailSlot;
+    }
+    theBoid->trailSlot = -1;
+}
+
+
+/*!
+    @brief Writes the position of a boid at the head of its trail
+    @param flockPtr A pointer to the flocks object
+    @param theBoid The boid, final for this step
+    @discussion Only the head moves, nothing is shifted. A boid without a trail yet gets its
+                position in every slot, so that a new trail does not reach back to the origin.
+ */
+void TrailAdd(t_jit_boids3d *flockPtr, BoidPtr theBoid)
+{
+    if(theBoid->trailSlot < 0){
+        return;
+    }
+    
+    float *trail = flockPtr->trails + theBoid->trailSlot*flockPtr->trailLength*3;
+    if(!theBoid->trailFilled){
+        for(long i=0; i<flockPtr->trailLength; i++){
+            trail[i*3+x] = theBoid->newPos[x];
+            trail[i*3+y] = theBoid->newPos[y];
+            trail[i*3+z] = theBoid->newPos[z];
+        }
+        theBoid->trailFilled = 1;
+        return;
+    }
+    
+    float *slot = trail + flockPtr->trailHead*3;
+    slot[x] = theBoid->newPos[x];
+    slot[y] = theBoid->newPos[y];
+    slot[z] = theBoid->newPos[z];
+}
+
+
+/*!
+    @brief Writes the trails as trailLength rows of the boids in the order of the 1st outlet
+    @param flockPtr A pointer to the flocks object
+    @param bop Row 0 gets the newest positions, row j the positions of j steps before
+    @param rowStride Bytes from one row to the next
+    @discussion Each boid's trail is read in one pass, from the head backwards around the ring.
+                Uses packBoids, so PackOrder must run first.
+ */
+void TrailPack(t_jit_boids3d *flockPtr, char *bop, long rowStride)
+{
+    long length = flockPtr->trailLength;
+    
+    for(long column=0; column<flockPtr->packCount; column++){
+        BoidPtr theBoid = flockPtr->packBoids[column];
+        
+        //a boid without a ring buffer stays where it is
+        float *trail = theBoid->trailSlot >= 0 ? flockPtr->trails + theBoid->trailSlot*length*3 : NULL;
+        long slot = flockPtr->trailHead;
+        for(long j=0; j<length; j++){
+            float *fop = (float *)(bop + j*rowStride) + column*3;
+            fop[0] = trail ? trail[slot*3+x] : theBoid->newPos[x];
+            fop[1] = trail ? trail[slot*3+y] : theBoid->newPos[y];
+            fop[2] = trail ? trail[slot*3+z] : theBoid->newPos[z];
+            slot = slot > 0 ? slot - 1 : length - 1;
+        }
+    }
+}
+
+
+//
+//
+//      MARK: Clusters
+//
+//
+
+
+/*!
+    @brief Gives every boid a slot in the union-find, as a cluster of its own
+    @param flockPtr A pointer to the flocks object
+    @discussion Boids past kMaxNumBoids get no slot and stay out of the clusters
+ */
+void ClusterBegin(t_jit_boids3d *flockPtr)
+{
+    int slot = 0;
+    
+    for(int i=0; i<MAX_FLOCKS; i++){
+        BoidPtr iterator = flockPtr->flockLL[i];
+        while(iterator){
+            if(slot < kMaxNumBoids){
+                flockPtr->clusterParent[slot] = slot;
+                flockPtr->clusterSize[slot] = 1;
+                iterator->clusterSlot = slot++;
+            }else{
+                iterator->clusterSlot = -1;
+            }
+            iterator = iterator->nextBoid;
+        }
+    }
+}
+
+
+/*!
+    @brief Returns the root slot of the cluster of a slot, halving the path on the way up
+ */
+int ClusterFind(t_jit_boids3d *flockPtr, int slot)
+{
+    while(flockPtr->clusterParent[slot] != slot){
+        flockPtr->clusterParent[slot] = flockPtr->clusterParent[flockPtr->clusterParent[slot]];
+        slot = flockPtr->clusterParent[slot];
+    }
+    return slot;
+}
+
+
+/*!
+    @brief Joins the clusters of two neighbors, the smaller under the larger
+    @discussion Called from the neighbor search for every pair it accepts, so clustering adds no pair tests
+ */
+void ClusterUnion(t_jit_boids3d *flockPtr, int slotA, int slotB)
+{
+    if(slotA < 0 || slotB < 0){
+        return;
+    }
+    
+    int rootA = ClusterFind(flockPtr, slotA);
+    int rootB = ClusterFind(flockPtr, slotB);
+    if(rootA == rootB){
+        return;
+    }
+    
+    if(flockPtr->clusterSize[rootA] < flockPtr->clusterSize[rootB]){
+        int swap = rootA;
+        rootA = rootB;
+        rootB = swap;
+    }
+    flockPtr->clusterParent[rootB] = rootA;
+    flockPtr->clusterSize[rootA] += flockPtr->clusterSize[rootB];
+}
+
+
+/*!
+    @brief Numbers the clusters of the step in output order and sums them up for the 9th outlet
+    @param flockPtr A pointer to the flocks object
+    @discussion A cluster is numbered when its first boid in the 1st outlet is reached. Boids that died
+                during the step can still have joined two clusters. Neighbor searches skipped by the
+                frame budget don't join anything, which can split a cluster for that step.
+ */
+void ClusterLabel(t_jit_boids3d *flockPtr)
+{
+    for(int i=0; i<kMaxNumBoids; i++){
+        flockPtr->clusterOfRoot[i] = -1;
+    }
+    flockPtr->numClusters = 0;
+    
+    for(int i=0; i<MAX_FLOCKS; i++){
+        BoidPtr iterator = flockPtr->flockLL[i];
+        while(iterator){
+            if(iterator->clusterSlot < 0){
+                iterator->clusterID = -1;
+                iterator = iterator->nextBoid;
+                continue;
+            }
+            
+            int root = ClusterFind(flockPtr, iterator->clusterSlot);
+            if(flockPtr->clusterOfRoot[root] < 0){
+                float *summary = flockPtr->clusterSummary[flockPtr->numClusters];
+                memset(summary, 0, kClusterPlanes*sizeof(float));
+                summary[7] = iterator->flockID;
+                flockPtr->clusterOfRoot[root] = flockPtr->numClusters++;
+            }
+            
+            //size, then sums that become means below
+            int cluster = flockPtr->clusterOfRoot[root];
+            float *summary = flockPtr->clusterSummary[cluster];
+            summary[0] += 1;
+            summary[1] += iterator->newPos[x];
+            summary[2] += iterator->newPos[y];
+            summary[3] += iterator->newPos[z];
+            summary[4] += iterator->newDir[x];
+            summary[5] += iterator->newDir[y];
+            summary[6] += iterator->newDir[z];
+            
+            iterator->clusterID = cluster;
+            iterator = iterator->nextBoid;
+        }
+    }
+    
+    for(long i=0; i<flockPtr->numClusters; i++){
+        float *summary = flockPtr->clusterSummary[i];
+        for(int j=1; j<7; j++){
+            summary[j] /= summary[0];
+        }
+    }
+}
+
+
+//
+//
+//      MARK: Half-float output
+//
+//
+
+
+/*!
+    @brief Converts a float to float16, rounding to nearest even
+    @param value The float
+    @return The float16 bits; values beyond JIT_HALF_MAX become infinity, NaN stays NaN
+    @discussion Integer operations with three short cases the compiler can turn into selects, so loops over it vectorize
+ */
+half FloatToHalf(float value)
+{
+    union { float f; uint32_t u; } bits, denormal;
+    uint32_t sign, magnitude;
+    half result;
+    
+    bits.f = value;
+    sign = bits.u & 0x80000000u;
+    magnitude = bits.u ^ sign;
+    
+    if(magnitude >= 0x47800000u){ //too large for a half: infinity, or NaN
+        result = (magnitude > 0x7f800000u) ? 0x7e00 : JIT_HALF_POSINF;
+    }else if(magnitude < 0x38800000u){ //denormal half or zero, let the float adder round it
+        denormal.u = magnitude;
+        denormal.f += 0.5f;
+        result = (half)(denormal.u - 0x3f000000u);
+    }else{ //normal half: rebias the exponent and round the mantissa to nearest even
+        uint32_t oddMantissa = (magnitude >> 13) & 1;
+        magnitude += ((uint32_t)(15 - 127) << 23) + 0xfff + oddMantissa;
+        result = (half)(magnitude >> 13);
+    }
+    
+    return result | (half)(sign >> 16);
+}
+
+
+/*!
+    @brief Converts an array of floats to float16
+    @param src count floats
+    @param dst count halves, may not overlap src
+ */
+void FloatsToHalves(const float *src, half *dst, long count)
+{
+    for(long i=0; i<count; i++){
+        dst[i] = FloatToHalf(src[i]);
+    }
+}
+
+
+//
+//
+//      MARK: Fast-forward and warm-up
+//
+//
+
+
+/*!
+    @brief Runs steps back to back without building any output
+    @param flockPtr A pointer to the flocks object
+    @param steps Number of steps
+    @param quit Stops early when it becomes nonzero, may be NULL
+    @discussion simLock is taken per step so setters can get in between. Only the last step builds
+                the render mirror, neighbor lines, histograms, statistics, clusters and density, as those
+                of the earlier ones would never be output.
+ */
+void FastForward(t_jit_boids3d *flockPtr, long steps, volatile char *quit)
+{
+    for(long i=0; i<steps && !(quit && *quit); i++){
+        
+        systhread_mutex_lock(flockPtr->simLock);
+        
+        FlightStep(flockPtr, i == steps-1);
+        
+        //these steps are not part of any output frame
+        memset(flockPtr->phaseTime, 0, sizeof(flockPtr->phaseTime));
+        
+        systhread_mutex_unlock(flockPtr->simLock);
+    }
+}
+
+
+/*!
+    @brief Stops the warm-up thread if one is running and waits for it to return
+    @param flockPtr A pointer to the flocks object
+ */
+void WarmupStop(t_jit_boids3d *flockPtr)
+{
+    unsigned int ret;
+    
+    if(!flockPtr->warmupThread){
+        return;
+    }
+    
+    flockPtr->warmupQuit = 1;
+    systhread_join(flockPtr->warmupThread, &ret);
+    flockPtr->warmupThread = NULL;
+    flockPtr->warming = 0;
+}
+
+
+/*!
+    @brief Body of the warm-up thread: runs warmupSteps steps, then lets the outputs resume
+    @param flockPtr A pointer to the flocks object
+ */
+void *WarmupThreadProc(t_jit_boids3d *flockPtr)
+{
+    TraceRecord(flockPtr, "warmup", 'B');
+    FastForward(flockPtr, flockPtr->warmupSteps, &flockPtr->warmupQuit);
+    TraceRecord(flockPtr, "warmup", 'E');
+    
+    flockPtr->warming = 0;
+    systhread_exit(0);
+    return NULL;
+}
+
+
+//
+//
+//      MARK: Chrome trace recording
+//
+//
+
+/*!
+    @brief Allocates the event buffer and starts recording
+    @param file the file the trace will be written to
+ */
+void TraceStart(t_jit_boids3d *flockPtr, t_symbol *file)
+{
+    flockPtr->traceEvents = (TraceEventPtr)malloc(sizeof(TraceEvent)*kMaxTraceEvents);
+    if(!flockPtr->traceEvents){
+        post("ERROR: trace: could not allocate the event buffer");
+        return;
+    }
+    
+    flockPtr->traceFile = file;
+    flockPtr->traceClaimed = 0;
+    flockPtr->traceCommitted = 0;
+    flockPtr->traceStart = systimer_gettime();
+    
+    //publish the buffer before writers can see tracing on
+    ATOMIC_INCREMENT_BARRIER(&flockPtr->traceWriters);
+    flockPtr->tracing = 1;
+    ATOMIC_DECREMENT_BARRIER(&flockPtr->traceWriters);
+}
+
+
+/*!
+    @brief Claims a slot of the trace buffer for an event
+    @return the slot, stamped with the time and thread, or NULL when not tracing or the buffer is full
+    @discussion Lock-free: a slot is claimed with an atomic increment, so any thread can record.
+                The writer count is raised before tracing is checked, so TraceStop() either sees the writer
+                or the writer sees the trace stopped. Every call must be followed by TraceRelease().
+ */
+TraceEventPtr TraceClaim(t_jit_boids3d *flockPtr)
+{
+    ATOMIC_INCREMENT_BARRIER(&flockPtr->traceWriters);
+    if(!flockPtr->tracing){
+        return NULL;
+    }
+    
+    long slot = ATOMIC_INCREMENT(&flockPtr->traceClaimed) - 1;
+    if(slot >= kMaxTraceEvents){
+        return NULL;
+    }
+    
+    TraceEventPtr event = &flockPtr->traceEvents[slot];
+    event->ts = (systimer_gettime() - flockPtr->traceStart) * 1000.0;
+    event->thread = systhread_self();
+    return event;
+}
+
+
+/*!
+    @brief Commits an event claimed by TraceClaim() and leaves the trace buffer
+    @param event the claimed slot, or NULL
+ */
+void TraceRelease(t_jit_boids3d *flockPtr, TraceEventPtr event)
+{
+    if(event){
+        ATOMIC_INCREMENT_BARRIER(&flockPtr->traceCommitted);
+    }
+    ATOMIC_DECREMENT_BARRIER(&flockPtr->traceWriters);
+}
+
+
+/*!
+    @brief Appends an event to the trace buffer
+    @param name static string naming the event
+    @param phase 'B'egin, 'E'nd or 'i'nstant
+    @discussion Events past the end of the buffer are dropped and counted when the trace is written.
+ */
+void TraceRecord(t_jit_boids3d *flockPtr, const char *name, char phase)
+{
+    if(!flockPtr->tracing){
+        return;
+    }
+    
+    TraceEventPtr event = TraceClaim(flockPtr);
+    if(event){
+        event->name = name;
+        event->phase = phase;
+    }
+    TraceRelease(flockPtr, event);
+}
+
+
+/*!
+    @brief Records the phase times of the current frame as a counter event
+ */
+void TraceCounters(t_jit_boids3d *flockPtr)
+{
+    if(!flockPtr->tracing){
+        return;
+    }
+    
+    TraceEventPtr event = TraceClaim(flockPtr);
+    if(event){
+        event->name = "phases";
+        event->phase = 'C';
+        for(int i=0; i<kNumProfilePhases; i++){
+            event->args[i] = flockPtr->phaseTime[i];
+        }
+    }
+    TraceRelease(flockPtr, event);
+}
+
+
+/*!
+    @brief Stops recording and writes the buffered events as Chrome trace JSON
+    @discussion Waits for every writer that saw the trace running to leave the buffer before reading and freeing it
+ */
+void TraceStop(t_jit_boids3d *flockPtr)
+{
+    if(!flockPtr->traceEvents){
+        return;
+    }
+    
+    flockPtr->tracing = 0;
+    
+    //the compare-and-swap is a full barrier, so writers entering after it see tracing off
+    while(!ATOMIC_COMPARE_SWAP32(0, 0, &flockPtr->traceWriters)){
+        systhread_sleep(1);
+    }
+    
+    long claimed = flockPtr->traceClaimed;
+    long count = MIN(claimed, kMaxTraceEvents);
+    
+    char path[MAX_PATH_CHARS];
+    if(path_nameconform(flockPtr->traceFile->s_name, path, PATH_STYLE_NATIVE, PATH_TYPE_BOOT)){
+        strncpy(path, flockPtr->traceFile->s_name, MAX_PATH_CHARS-1);
+        path[MAX_PATH_CHARS-1] = 0;
+    }
+    
+    FILE *file = fopen(path, "w");
+    if(!file){
+        post("ERROR: trace: could not open %s", path);
+    }else{
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for(long i=0; i<count; i++){
+            TraceEventPtr event = &flockPtr->traceEvents[i];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%lu",
+                    i ? ",\n" : "", event->name, event->phase, event->ts, (unsigned long)(t_ptr_uint)event->thread);
+            if(event->phase == 'C'){
+                fprintf(file, ",\"args\":{");
+                for(int j=0; j<kNumProfilePhases; j++){
+                    fprintf(file, "%s\"%s\":%.4f", j ? "," : "", kProfilePhaseNames[j], event->args[j]);
+                }
+                fprintf(file, "}");
+            }else if(event->phase == 'i'){
+                fprintf(file, ",\"s\":\"t\"");
+            }
+            fprintf(file, "}");
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        post("trace: wrote %ld events to %s (%ld dropped)", count, path, claimed - count);
+    }
+    
+    free(flockPtr->traceEvents);
+    flockPtr->traceEvents = NULL;
+}
+
+
+//
+//
+//      MARK: Golden-trajectory regression harness
+//
+//
+
+/*
+ * Per-boid record in a golden frame: newPos[3], newDir[3], oldPos[3], oldDir[3], speed, age
+ * oldPos/oldDir are part of the state because FlightStep updates boids in place, so boids later in
+ * the list still see the previous values of the boids that have not been stepped yet
+ */
+#define kGoldenStride 14
+
+/*
+ * Paths of the 1st outlet a golden mode can compare with the packed output instead of comparing a trajectory
+ */
+#define kGoldenTrajectory 0 // the mode steps differently, compare the positions
+#define kGoldenMirror 1 // the render mirror FlightStep writes
+#define kGoldenHalf 2 // float16, as the halfoutput attribute sends it
+
+/*
+ * Stored golden trajectory: a GoldenHeader, then frames+1 frames of numBoids*kGoldenStride doubles
+ */
+#define kGoldenMagic 0x676f6c64 // "gold"
+#define kGoldenVersion 1
+
+/*!
+ * @typedef GoldenHeader
+ * @brief Start of a stored golden trajectory, which is used only if all of it matches the run
+ */
+typedef struct GoldenHeader {
+    long magic;
+    long version;
+    long stride; // kGoldenStride it was written with
+    long frames;
+    long boidsPerFlock;
+    unsigned long params; // GoldenParamsHash of the scenario
+} GoldenHeader;
+
+/*!
+ * @typedef GoldenMode
+ * @brief One kernel configuration or output path that the golden harness compares against the reference
+ * @discussion For a trajectory, tolerance bounds the one-step error (restarted from the reference state every frame).
+ *             0 means the mode must reproduce positions and directions bit for bit. Otherwise it bounds the
+ *             rms position error as a fraction of the longest step a boid can take, which stays meaningful
+ *             for approximations where a few boids turn around (their error is then up to two steps).
+ *             For an output path, 0 means the same bytes as the packed 1st outlet, otherwise it bounds the
+ *             error of every value relative to the value.
+ */
+typedef struct GoldenMode {
+    const char *name;
+    double tolerance;
+    void (*configure)(t_jit_boids3d *sim, long level); // switches the scratch simulation to this mode, NULL for the default kernel
+    long level; // passed to configure
+    long output; // kGoldenTrajectory, or the path of the 1st outlet that is compared
+} GoldenMode;
+
+static GoldenMode goldenModes[] = {
+    {"reference",   0.0,        GoldenNoFlockSkip,  0,  kGoldenTrajectory}, // the kernel the trajectory is recorded with
+    {"flock skip",  0.0,        NULL,               0,  kGoldenTrajectory}, // skips flocks out of reach, must be exact
+    {"budget 1",    0.75,       GoldenBudgetLevel,  1,  kGoldenTrajectory}, // neighbor cap
+    {"budget 2",    1.0,        GoldenBudgetLevel,  2,  kGoldenTrajectory}, // neighbor cap, staggered neighbor search
+    {"budget 3",    1.0,        GoldenBudgetLevel,  3,  kGoldenTrajectory}, // tighter cap, staggered every 4th step
+    {"mirror",      0.0,        NULL,               0,  kGoldenMirror},     // render mirror against the packed rows
+    {"float16",     1.0/2048,   NULL,               0,  kGoldenHalf},       // half of 11 significant bits
+};
+#define kNumGoldenModes (sizeof(goldenModes)/sizeof(GoldenMode))
+
+
+/*!
+    @brief Runs every kernel mode and output path against a seeded reference trajectory and posts divergence statistics
+    @param argv Arguments coming from the max patch (all optional):
+            [0] = number of frames to record (default 200)
+            [1] = number of boids in each flock (default 50)
+            [2] = seed for the scenario (default 1)
+            [3] = 1 to record the reference again and store it over the one kept for this seed (default 0)
+    @discussion The scenario is built in a scratch simulation that copies the current flock parameters and
+                attractors, so the running flocks are not touched. Boids are immortal in the scenario so that
+                every mode steps the same set of boids.
+                The reference is recorded with the kernel that tests every boid of every flock, and stored in
+                goldendir, one file per seed. Later runs with the same frames, boids and parameters compare
+                against the stored trajectory, so a change to the kernel shows up in the "reference" mode.
+ */
+t_jit_err jit_boids3d_golden(t_jit_boids3d *flockPtr, void *attr, long argc, t_atom *argv)
+{
+    TraceRecord(flockPtr, "golden", 'B');
+    long frames = (argc > 0) ? (long)jit_atom_getlong(argv) : 200;
+    long boidsPerFlock = (argc > 1) ? (long)jit_atom_getlong(argv+1) : 50;
+    unsigned long seed = (argc > 2) ? (unsigned long)jit_atom_getlong(argv+2) : 1;
+    char record = (argc > 3) ? (char)(jit_atom_getlong(argv+3) != 0) : 0;
+    
+    frames = MAX(frames, 1);
+    boidsPerFlock = CLAMP(boidsPerFlock, 1, kMaxNumBoids/MAX_FLOCKS);
+    
+    flockPtr->goldenArgs[0] = frames;
+    flockPtr->goldenArgs[1] = boidsPerFlock;
+    flockPtr->goldenArgs[2] = (long)seed;
+    flockPtr->goldenArgs[3] = record;
+    
+    long numBoids = boidsPerFlock*MAX_FLOCKS;
+    long frameSize = numBoids*kGoldenStride;
+    
+    double *reference = (double *)malloc(sizeof(double)*frameSize*(frames+1));
+    double *frame = (double *)malloc(sizeof(double)*frameSize);
+    t_jit_boids3d *sim = GoldenInitScenario(flockPtr, boidsPerFlock, seed);
+    if(!reference || !frame || !sim){
+        post("ERROR: golden: could not allocate the scenario");
+        free(reference);
+        free(frame);
+        GoldenFreeScenario(sim);
+        TraceRecord(flockPtr, "golden", 'E');
+        return JIT_ERR_OUT_OF_MEM;
+    }
+    
+    //longest step a boid can take, the unit of the tolerances
+    double stepLength = 0;
+    for(int i=0; i<MAX_FLOCKS; i++){
+        stepLength = MAX(stepLength, 0.5*sim->maxspeed[i]*(sim->speed[i]/100.0));
+    }
+    
+    post(" - - GOLDEN - - ");
+    post("%ld frames, %ld boids, seed %lu, step length %g", frames, numBoids, seed, stepLength);
+    
+    //the stored reference trajectory, or a new one (frame 0 is the initial state)
+    char path[MAX_PATH_CHARS];
+    unsigned long params = GoldenParamsHash(sim);
+    GoldenPath(flockPtr, seed, path);
+    if(!record && GoldenLoad(path, frames, boidsPerFlock, params, reference, frameSize)){
+        post("reference: stored in %s", path);
+    }else{
+        GoldenNoFlockSkip(sim, 0);
+        GoldenRecordFrame(sim, reference);
+        for(long f=1; f<=frames; f++){
+            FlightStep(sim, 0);
+            GoldenRecordFrame(sim, reference + f*frameSize);
+        }
+        
+        FILE *file = fopen(path, "rb");
+        if(file && !record){
+            fclose(file);
+            post("reference: recorded, %s was made with other frames, boids or parameters (add 1 to store this one)", path);
+        }else{
+            if(file){
+                fclose(file);
+            }
+            GoldenSave(path, frames, boidsPerFlock, params, reference, frameSize);
+        }
+    }
+    GoldenFreeScenario(sim);
+    
+    for(int m=0; m<kNumGoldenModes; m++){
+        GoldenMode *mode = &goldenModes[m];
+        
+        sim = GoldenInitScenario(flockPtr, boidsPerFlock, seed);
+        if(!sim){
+            post("ERROR: golden: could not allocate the scenario");
+            break;
+        }
+        if(mode->configure){
+            mode->configure(sim, mode->level);
+        }
+        
+        if(mode->output != kGoldenTrajectory){
+            post("%s:", mode->name);
+            GoldenOutputCheck(sim, reference, frames, frameSize, mode->output, mode->tolerance);
+            GoldenFreeScenario(sim);
+            continue;
+        }
+        
+        //one-step error: restart from the reference state every frame
+        double stepPosErr = 0, stepDirErr = 0, sumSqrStepErr = 0;
+        for(long f=0; f<frames; f++){
+            GoldenRestoreFrame(sim, reference + f*frameSize);
+            FlightStep(sim, 0);
+            GoldenRecordFrame(sim, frame);
+            
+            double *expected = reference + (f+1)*frameSize;
+            for(long b=0; b<numBoids; b++){
+                double distSqr = DistSqrToPt(frame + b*kGoldenStride, expected + b*kGoldenStride);
+                sumSqrStepErr += distSqr;
+                stepPosErr = MAX(stepPosErr, sqrt(distSqr));
+                stepDirErr = MAX(stepDirErr, sqrt(DistSqrToPt(frame + b*kGoldenStride+3, expected + b*kGoldenStride+3)));
+            }
+        }
+        
+        //trajectory drift: run freely from the initial state
+        double maxDrift = 0, sumSqrDrift = 0, finalDrift = 0;
+        long firstDivergentFrame = -1;
+        GoldenRestoreFrame(sim, reference);
+        for(long f=1; f<=frames; f++){
+            FlightStep(sim, 0);
+            GoldenRecordFrame(sim, frame);
+            
+            double *expected = reference + f*frameSize;
+            double frameDrift = 0;
+            for(long b=0; b<numBoids; b++){
+                double distSqr = DistSqrToPt(frame + b*kGoldenStride, expected + b*kGoldenStride);
+                sumSqrDrift += distSqr;
+                frameDrift = MAX(frameDrift, sqrt(distSqr));
+            }
+            if(frameDrift > mode->tolerance*stepLength && firstDivergentFrame < 0){
+                firstDivergentFrame = f;
+            }
+            maxDrift = MAX(maxDrift, frameDrift);
+            finalDrift = frameDrift;
+        }
+        GoldenFreeScenario(sim);
+        
+        double stepRmsErr = sqrt(sumSqrStepErr/(frames*numBoids));
+        char passed;
+        if(mode->tolerance == 0.0){
+            passed = (stepPosErr == 0.0 && stepDirErr == 0.0);
+        }else{
+            passed = (stepRmsErr <= mode->tolerance*stepLength);
+        }
+        post("%s: %s (tolerance %g steps)", mode->name, passed ? "PASS" : "FAIL", mode->tolerance);
+        post("   step error: position max %g, rms %g, direction max %g", stepPosErr, stepRmsErr, stepDirErr);
+        post("   drift: max %g, rms %g, final %g, diverged at frame %ld", maxDrift,
+             sqrt(sumSqrDrift/(frames*numBoids)), finalDrift, firstDivergentFrame);
+    }
+    
+    post("- - - - - - -");
+    
+    free(reference);
+    free(frame);
+    TraceRecord(flockPtr, "golden", 'E');
+    return JIT_ERR_NONE;
+}
+
+
+/*!
+    @brief Builds a scratch simulation with the current parameters and a seeded population
+    @param flockPtr the live flock object the parameters and attractors are copied from
+    @param boidsPerFlock number of boids created in every flock
+    @param seed seed for the boid positions and directions
+    @return the scratch simulation, or NULL if it could not be allocated
+    @discussion Flocks that the patch never configured fall back to the initial flight parameters
+ */
+t_jit_boids3d *GoldenInitScenario(t_jit_boids3d *flockPtr, long boidsPerFlock, unsigned long seed)
+{
+    t_jit_boids3d *sim = (t_jit_boids3d *)calloc(1, sizeof(t_jit_boids3d));
+    if(!sim){
+        return NULL;
+    }
+    
+    for(int i=0; i<6; i++){
+        sim->flyrect[i] = flockPtr->flyrect[i];
+    }
+    sim->flyRectCount = flockPtr->flyRectCount;
+    sim->allowNeighborsFromDiffFlock = flockPtr->allowNeighborsFromDiffFlock;
+    memcpy(sim->flockSees, flockPtr->flockSees, sizeof(sim->flockSees));
+    memcpy(sim->flockWeights, flockPtr->flockWeights, sizeof(sim->flockWeights));
+    sim->d2r = flockPtr->d2r;
+    sim->r2d = flockPtr->r2d;
+    
+    for(int i=0; i<MAX_FLOCKS; i++){
+        if(flockPtr->inertia[i] == 0.0){ //never configured
+            sim->minspeed[i]        = kMinSpeed;
+            sim->maxspeed[i]        = kMaxSpeed;
+            sim->center[i]          = kCenterWeight;
+            sim->attract[i]         = kAttractWeight;
+            sim->match[i]           = kMatchWeight;
+            sim->sepwt[i]           = kSepWeight;
+            sim->sepdist[i]         = kSepDist;
+            sim->speed[i]           = kDefaultSpeed;
+            sim->inertia[i]         = kInertiaFactor;
+            sim->accel[i]           = kAccelFactor;
+            sim->neighborRadius[i]  = kNRadius;
+        }else{
+            sim->minspeed[i]        = flockPtr->minspeed[i];
+            sim->maxspeed[i]        = flockPtr->maxspeed[i];
+            sim->center[i]          = flockPtr->center[i];
+            sim->attract[i]         = flockPtr->attract[i];
+            sim->match[i]           = flockPtr->match[i];
+            sim->sepwt[i]           = flockPtr->sepwt[i];
+            sim->sepdist[i]         = flockPtr->sepdist[i];
+            sim->speed[i]           = flockPtr->speed[i];
+            sim->inertia[i]         = flockPtr->inertia[i];
+            sim->accel[i]           = flockPtr->accel[i];
+            sim->neighborRadius[i]  = flockPtr->neighborRadius[i];
+        }
+        sim->age[i] = -1; //immortal, so every mode steps the same boids
+    }
+    
+    //the fields of the 1st outlet, for the output paths
+    sim->mode = flockPtr->mode;
+    memcpy(sim->outputPlanes, flockPtr->outputPlanes, sizeof(sim->outputPlanes));
+    sim->outputPlanesCount = flockPtr->outputPlanesCount;
+    memcpy(sim->flockColor, flockPtr->flockColor, sizeof(sim->flockColor));
+    memcpy(sim->flockScale, flockPtr->flockScale, sizeof(sim->flockScale));
+    memcpy(sim->camera, flockPtr->camera, sizeof(sim->camera));
+    memcpy(sim->lodDistances, flockPtr->lodDistances, sizeof(sim->lodDistances));
+    sim->lodCount = flockPtr->lodCount;
+    OutputLayoutUpdate(sim);
+    sim->stepAlpha = 1.0;
+    
+    //copy the attractors, keeping their order
+    AttractorPtr *tail = &sim->attractorLL;
+    AttractorPtr iterator = flockPtr->attractorLL;
+    while(iterator){
+        AttractorPtr copy = InitAttractor(sim);
+        if(!copy){
+            GoldenFreeScenario(sim);
+            return NULL;
+        }
+        *copy = *iterator;
+        copy->nextAttractor = NULL;
+        *tail = copy;
+        tail = &copy->nextAttractor;
+        sim->numAttractors++;
+        iterator = iterator->nextAttractor;
+    }
+    
+    //seeded population, every flock in its own slab of the flyrect so that the flock skip has flocks out of reach
+    unsigned long state = seed;
+    double slab = (sim->flyrect[right]-sim->flyrect[left]) / MAX_FLOCKS;
+    for(int i=0; i<MAX_FLOCKS; i++){
+        for(long j=0; j<boidsPerFlock; j++){
+            BoidPtr theBoid = InitBoid(sim);
+            if(!theBoid){
+                GoldenFreeScenario(sim);
+                return NULL;
+            }
+            theBoid->flockID = i;
+            theBoid->newPos[x] = theBoid->oldPos[x] = kFlyRectScalingFactor*(sim->flyrect[left] + (i + GoldenRandom(&state))*slab);
+            theBoid->newPos[y] = theBoid->oldPos[y] = kFlyRectScalingFactor*(sim->flyrect[bottom] + GoldenRandom(&state)*(sim->flyrect[top]-sim->flyrect[bottom]));
+            theBoid->newPos[z] = theBoid->oldPos[z] = kFlyRectScalingFactor*(sim->flyrect[back] + GoldenRandom(&state)*(sim->flyrect[front]-sim->flyrect[back]));
+            theBoid->newDir[x] = GoldenRandom(&state)*2.0 - 1.0;
+            theBoid->newDir[y] = GoldenRandom(&state)*2.0 - 1.0;
+            theBoid->newDir[z] = GoldenRandom(&state)*2.0 - 1.0;
+            NormalizeVelocity(theBoid->newDir);
+            
+            //append so the list order matches the globalIDs
+            theBoid->nextBoid = NULL;
+            if(!sim->flockLL[i]){
+                sim->flockLL[i] = theBoid;
+            }else{
+                BoidPtr last = sim->flockLL[i];
+                while(last->nextBoid){
+                    last = last->nextBoid;
+                }
+                last->nextBoid = theBoid;
+            }
+            sim->boidCount[i]++;
+        }
+    }
+    
+    return sim;
+}
+
+
+/*!
+    @brief Frees a scratch simulation made by GoldenInitScenario()
+ */
+void GoldenFreeScenario(t_jit_boids3d *sim)
+{
+    if(!sim){
+        return;
+    }
+    
+    freeFlocks(sim);
+    
+    AttractorPtr iterator = sim->attractorLL;
+    while(iterator){
+        AttractorPtr deletor = iterator;
+        iterator = iterator->nextAttractor;
+        free(deletor);
+    }
+    
+    free(sim);
 }
 
 
 /*!
-    @brief Computes a normalized direction vector from a boid to a seek point
-    @param flockPtr A pointer to the flocks object
-    @param theBoid The boid object that the direction vector is calculated for
-    @param seekPt The point that the boid is seeking
-    @param seekDir The calculated direction is stored here
+    @brief Writes the state of every boid into a frame, indexed by globalID
  */
-void SeekPoint(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *seekPt, double* seekDir)
+void GoldenRecordFrame(t_jit_boids3d *sim, double *frame)
 {
-    seekDir[x] = seekPt[x] - theBoid->oldPos[x];
-    seekDir[y] = seekPt[y] - theBoid->oldPos[y];
-    seekDir[z] = seekPt[z] - theBoid->oldPos[z];
-    NormalizeVelocity(seekDir);
+    for(int i=0; i<MAX_FLOCKS; i++){
+        BoidPtr iterator = sim->flockLL[i];
+        while(iterator){
+            double *record = frame + iterator->globalID*kGoldenStride;
+            record[0] = iterator->newPos[x];
+            record[1] = iterator->newPos[y];
+            record[2] = iterator->newPos[z];
+            record[3] = iterator->newDir[x];
+            record[4] = iterator->newDir[y];
+            record[5] = iterator->newDir[z];
+            record[6] = iterator->oldPos[x];
+            record[7] = iterator->oldPos[y];
+            record[8] = iterator->oldPos[z];
+            record[9] = iterator->oldDir[x];
+            record[10] = iterator->oldDir[y];
+            record[11] = iterator->oldDir[z];
+            record[12] = iterator->speed;
+            record[13] = iterator->age;
+            iterator = iterator->nextBoid;
+        }
+    }
 }
 
 
-
 /*!
-    @brief Computes a normalized seek direction from a boid towards every attractor
-    @param flockPtr A pointer to the flocks object
-    @param theBoid The boid object that the direction vector is calculated for
-    @param seekDir The calculated direction is stored here
+    @brief Puts every boid back into the state stored in a frame
  */
-void SeekAttractors(t_jit_boids3d *flockPtr, BoidPtr theBoid, double* seekDir)
+void GoldenRestoreFrame(t_jit_boids3d *sim, double *frame)
 {
-    AttractorPtr iterator = flockPtr->attractorLL;
-    
-    //iterate thru and sum up the direction to all attractors
-    while(iterator){
-        
-        double dist = sqrt(DistSqrToPt(iterator->loc, theBoid->oldPos));
-        
-        //ensure that the boid is in range of the attractor and it is allowed to feel attraction to this attractor
-        if(dist < iterator->attractorRadius && (iterator->onlyAttractedFlockID == -1 || iterator->onlyAttractedFlockID == theBoid->flockID)){
-            seekDir[x] += iterator->loc[x]-theBoid->oldPos[x];
-            seekDir[y] += iterator->loc[y]-theBoid->oldPos[y];
-            seekDir[z] += iterator->loc[z]-theBoid->oldPos[z];
+    for(int i=0; i<MAX_FLOCKS; i++){
+        BoidPtr iterator = sim->flockLL[i];
+        while(iterator){
+            double *record = frame + iterator->globalID*kGoldenStride;
+            iterator->newPos[x] = record[0];
+            iterator->newPos[y] = record[1];
+            iterator->newPos[z] = record[2];
+            iterator->newDir[x] = record[3];
+            iterator->newDir[y] = record[4];
+            iterator->newDir[z] = record[5];
+            iterator->oldPos[x] = record[6];
+            iterator->oldPos[y] = record[7];
+            iterator->oldPos[z] = record[8];
+            iterator->oldDir[x] = record[9];
+            iterator->oldDir[y] = record[10];
+            iterator->oldDir[z] = record[11];
+            iterator->speed = record[12];
+            iterator->age = (int)record[13];
+            iterator = iterator->nextBoid;
         }
-        
-        iterator = iterator->nextAttractor;
     }
-    
-    NormalizeVelocity(seekDir);
 }
 
 
 /*!
-    @brief Bounces boids back from the walls of the simulation if necessary
-    @param flockPtr A point to the flocks object
-    @param theBoid The boid object that is being bounced back from the walls
-    @param wallVel The resulting direction after bouncing off the wall
+    @brief Pins the scratch simulation to a frame budget degradation level (golden modes "budget 1" to "budget 3")
+    @param level one of the budget levels, 1 to kNumBudgetLevels-1
  */
-void AvoidWalls(t_jit_boids3d *flockPtr, BoidPtr theBoid, double *wallVel)
+void GoldenBudgetLevel(t_jit_boids3d *sim, long level)
 {
-    double		testPoint[3];
-    
-    /* calculate test point in front of the nose of the boid */
-    /* distance depends on the boid's speed and the avoid edge constant */
-    testPoint[x] = theBoid->oldPos[x] + theBoid->newDir[x] * (theBoid->speed * (flockPtr->speed[theBoid->flockID] / 100.0));// * flockPtr->edgedist[flockPtr->boid[theBoid].flockID];
-    testPoint[y] = theBoid->oldPos[y] + theBoid->newDir[y] * (theBoid->speed * (flockPtr->speed[theBoid->flockID] / 100.0));// * flockPtr->edgedist[flockPtr->boid[theBoid].flockID];
-    testPoint[z] = theBoid->oldPos[z] + theBoid->newDir[z] * (theBoid->speed * (flockPtr->speed[theBoid->flockID] / 100.0));// * flockPtr->edgedist[flockPtr->boid[theBoid].flockID];
-    
-    
-    /* if test point is out of the left (right) side of flockPtr->flyrect, */
-    /* return a positive (negative) horizontal velocity component */
-    if (testPoint[x] < flockPtr->flyrect[left]*kFlyRectScalingFactor)
-        wallVel[x] = ABS(wallVel[x]);
-    else if (testPoint[x] > flockPtr->flyrect[right]*kFlyRectScalingFactor)
-        wallVel[x] = - ABS(wallVel[x]);
-    
-    /* same with top and bottom */
-    if (testPoint[y] > flockPtr->flyrect[top]*kFlyRectScalingFactor)
-        wallVel[y] = - ABS(wallVel[y]);
-    else if (testPoint[y] < flockPtr->flyrect[bottom]*kFlyRectScalingFactor)
-        wallVel[y] = ABS(wallVel[y]);
-    
-    /* same with front and back*/
-    if (testPoint[z] > flockPtr->flyrect[front]*kFlyRectScalingFactor)
-        wallVel[z] = - ABS(wallVel[z]);
-    else if (testPoint[z] < flockPtr->flyrect[back]*kFlyRectScalingFactor)
-        wallVel[z] = ABS(wallVel[z]);
+    sim->budgetLevel = CLAMP(level, 0, kNumBudgetLevels-1);
 }
 
 
 /*!
-    @brief Determines if a neighbor boid is in front of a given boid
-    @param theBoid A boid
-    @param neighbor A different boid - calculates if this boid is in front of theBoid
-    @return 0 if neighbor is not in front, 1 if it is
+    @brief Makes the scratch simulation test every boid of every flock (golden mode "reference")
+    @discussion The brute-force search the flock skip has to reproduce, and the kernel the reference trajectory is recorded with
  */
-char InFront(BoidPtr theBoid, BoidPtr neighbor)
+void GoldenNoFlockSkip(t_jit_boids3d *sim, long level)
 {
-    float	grad, intercept;
-    char result;
-    
-    /* we do this on 2 planes, xy, yz. if one returns false then we know its behind. a.sier/jasch 08/2005
-     
-     Find the gradient and y-intercept of a line passing through theBoid's oldPos
-     perpendicular to its direction of motion.  Another boid is in front of theBoid
-     if it is to the right or left of this linedepending on whether theBoid is moving
-     right or left.  However, if theBoid is travelling vertically then just compare
-     their vertical coordinates.
-     
-     */
-    // xy plane
+    sim->flockSkipOff = 1;
+}
+
+
+/*!
+    @brief Compares a path of the 1st outlet with the packed rows, stepping once from every reference frame
+    @param sim The scratch simulation, in the default kernel
+    @param reference frames+1 frames of the reference trajectory
+    @param output kGoldenMirror or kGoldenHalf
+    @param tolerance 0 for the same bytes, otherwise the largest error relative to the value
+    @discussion The rows are packed by calculate_ndim with the render mirror marked out of date, as when
+                cull or depthsort are on
+ */
+void GoldenOutputCheck(t_jit_boids3d *sim, double *reference, long frames, long frameSize, long output, double tolerance)
+{
+    long planecount = OutputPlanecount(sim);
+    float *packed = (float *)malloc(sizeof(float)*kMaxNumBoids*kMaxOutputPlanes);
+    float *compared = (float *)malloc(sizeof(float)*kMaxNumBoids*kMaxOutputPlanes);
+    half *halves = (half *)malloc(sizeof(half)*kMaxNumBoids*kMaxOutputPlanes);
+    if(!packed || !compared || !halves){
+        post("ERROR: golden: could not allocate the output");
+        free(packed);
+        free(compared);
+        free(halves);
+        return;
+    }
     
-    // if theBoid is not travelling vertically...
-    if (theBoid->oldDir[x] != 0) {
-        // calculate gradient of a line _perpendicular_ to its direction (hence the minus)
-        grad = -theBoid->oldDir[y] / theBoid->oldDir[x];
-        
-        // calculate where this line hits the y axis (from y = mx + c)
-        intercept = theBoid->oldPos[y] - (grad * theBoid->oldPos[x]);
+    double maxErr = 0, maxRelative = 0;
+    long differing = 0, values = 0, unused = 0;
+    for(long f=0; f<frames; f++){
+        GoldenRestoreFrame(sim, reference + f*frameSize);
+        FlightStep(sim, 1);
         
-        /* compare the horizontal position of the neighbor boid with */
-        /* the point on the line that has its vertical coordinate */
-        if (neighbor->oldPos[x] >= ((neighbor->oldPos[y] - intercept) / grad)) {
-            /* return true if the first boid's horizontal movement is +ve */
-            result = (theBoid->oldDir[x] > 0);
-            
-            if (result==0) return 0;
-            else goto next;
-            
-        } else {
-            /* return true if the first boid's horizontal movement is +ve */
-            result = (theBoid->oldDir[x] < 0);
-            if (result==0) return 0;
-            else goto next;
+        long dim[2] = {PackOrder(sim), 1};
+        long count = dim[0]*planecount;
+        if(output == kGoldenMirror){
+            unused += sim->mirrorPlanecount != planecount || sim->mirrorCount != dim[0];
+            jit_boids3d_calculate_ndim(sim, 2, dim, planecount, NULL, (char *)compared);
         }
-    }
-    /* else theBoid is travelling vertically, so just compare vertical coordinates */
-    else if (theBoid->oldDir[y] > 0) {
-        result = (neighbor->oldPos[y] > theBoid->oldPos[y]);
-        if (result==0){
-            return 0;
-        }else{
-            goto next;
+        sim->mirrorPlanecount = 0;
+        jit_boids3d_calculate_ndim(sim, 2, dim, planecount, NULL, (char *)packed);
+        if(output == kGoldenHalf){
+            FloatsToHalves(packed, halves, count);
+            for(long i=0; i<count; i++){
+                compared[i] = jit_half_to_float(halves[i]);
+            }
         }
-    }else{
-        result = (neighbor->oldPos[y] < theBoid->oldPos[y]);
-        if (result==0){
-            return 0;
-        } else {
-            goto next;
+        
+        for(long i=0; i<count; i++){
+            double err = fabs((double)compared[i] - packed[i]);
+            differing += memcmp(&compared[i], &packed[i], sizeof(float)) != 0;
+            maxErr = MAX(maxErr, err);
+            if(packed[i] != 0){
+                maxRelative = MAX(maxRelative, err/fabs(packed[i]));
+            }else if(err > 0){
+                maxRelative = MAX(maxRelative, 1.0);
+            }
         }
+        values += count;
     }
-next:
     
-    // yz plane
+    char passed = (tolerance == 0.0) ? (differing == 0 && unused == 0) : (maxRelative <= tolerance);
+    post("   %s (tolerance %g relative): %ld of %ld values differ, max error %g, max relative error %g",
+         passed ? "PASS" : "FAIL", tolerance, differing, values, maxErr, maxRelative);
+    if(unused > 0){
+        post("   the mirror was not written in %ld of %ld frames", unused, frames);
+    }
     
-    // if theBoid is not travelling vertically...
-    if (theBoid->oldDir[y] != 0) {
-        // calculate gradient of a line _perpendicular_ to its direction (hence the minus)
-        grad = -theBoid->oldDir[z] / theBoid->oldDir[y];
-        
-        // calculate where this line hits the y axis (from y = mx + c)
-        intercept = theBoid->oldPos[z] - (grad * theBoid->oldPos[y]);
-        
-        // compare the horizontal position of the neighbor boid with
-        // the point on the line that has its vertical coordinate
-        if (neighbor->oldPos[y] >= ((neighbor->oldPos[z] - intercept) / grad)) {
-            // return true if the first boid's horizontal movement is +ve
-            result = (theBoid->oldDir[y] > 0);
-            if (result==0){
-                return 0;
-            }else{
-                goto next2;
-            }
-        } else {
-            // return true if the first boid's horizontal movement is +ve
-            result = (theBoid->oldDir[y] < 0);
-            if (result==0){
-                return 0;
-            }else{
-                goto next2;
-            }
+    free(packed);
+    free(compared);
+    free(halves);
+}
+
+
+/*!
+    @brief Hashes everything the trajectory of the scenario depends on besides the seed and the kernel
+    @return FNV-1a of the flyrect, the flock parameters and interactions, and the attractors
+ */
+unsigned long GoldenParamsHash(t_jit_boids3d *sim)
+{
+    unsigned long hash = 2166136261UL;
+    const void *fields[] = {sim->flyrect, &sim->allowNeighborsFromDiffFlock, sim->flockSees, sim->flockWeights,
+                            sim->minspeed, sim->maxspeed, sim->center, sim->attract, sim->match, sim->sepwt,
+                            sim->sepdist, sim->speed, sim->inertia, sim->accel, sim->neighborRadius};
+    const size_t sizes[] = {sizeof(sim->flyrect), sizeof(sim->allowNeighborsFromDiffFlock), sizeof(sim->flockSees),
+                            sizeof(sim->flockWeights), sizeof(sim->minspeed), sizeof(sim->maxspeed), sizeof(sim->center),
+                            sizeof(sim->attract), sizeof(sim->match), sizeof(sim->sepwt), sizeof(sim->sepdist),
+                            sizeof(sim->speed), sizeof(sim->inertia), sizeof(sim->accel), sizeof(sim->neighborRadius)};
+    
+    for(int i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++){
+        for(size_t j=0; j<sizes[i]; j++){
+            hash = (hash ^ ((const unsigned char *)fields[i])[j]) * 16777619UL;
         }
     }
-    // else theBoid is travelling vertically, so just compare vertical coordinates
-    else if (theBoid->oldDir[z] > 0) {
-        result = (neighbor->oldPos[z] > theBoid->oldPos[z]);
-        if (result==0){
-            return 0;
-        }else{
-            goto next2;
-        }
-    }else{
-        result = (neighbor->oldPos[z] < theBoid->oldPos[z]);
-        if (result==0){
-            return 0;
-        }else{
-            goto next2;
+    
+    for(AttractorPtr iterator = sim->attractorLL; iterator; iterator = iterator->nextAttractor){
+        const double attractor[5] = {iterator->loc[0], iterator->loc[1], iterator->loc[2],
+                                     iterator->attractorRadius, iterator->onlyAttractedFlockID};
+        for(size_t j=0; j<sizeof(attractor); j++){
+            hash = (hash ^ ((const unsigned char *)attractor)[j]) * 16777619UL;
         }
     }
-next2:
-    return 1;
+    
+    return hash;
 }
 
-void NormalizeVelocity(double *direction)
+
+/*!
+    @brief Finds the file of the golden trajectory of a seed, jit.boids3d.golden.<seed> in goldendir
+    @param path MAX_PATH_CHARS characters, the native path is written here
+ */
+void GoldenPath(t_jit_boids3d *flockPtr, unsigned long seed, char *path)
 {
-    float	hypot;
+    char name[MAX_PATH_CHARS];
     
-    hypot = jit_math_sqrt(direction[x] * direction[x] + direction[y] * direction[y] + direction[z] * direction[z] );
+    if(flockPtr->goldenDir && flockPtr->goldenDir->s_name[0]){
+        snprintf(name, MAX_PATH_CHARS, "%s/jit.boids3d.golden.%lu", flockPtr->goldenDir->s_name, seed);
+    }else{
+        snprintf(name, MAX_PATH_CHARS, "jit.boids3d.golden.%lu", seed);
+    }
     
-    if (hypot != 0.0) {
-        direction[x] = direction[x] / hypot;
-        direction[y] = direction[y] / hypot;
-        direction[z] = direction[z] / hypot;
+    if(path_nameconform(name, path, PATH_STYLE_NATIVE, PATH_TYPE_BOOT)){
+        strncpy(path, name, MAX_PATH_CHARS-1);
+        path[MAX_PATH_CHARS-1] = 0;
     }
 }
 
 
 /*!
-    @brief Returns a random integer in the specified range
+    @brief Reads a stored golden trajectory
+    @param reference frames+1 frames are read into it
+    @return 1 if the file exists and was recorded with the same frames, boids and parameters, otherwise 0
  */
-double RandomInt(double minRange, double maxRange)
+char GoldenLoad(const char *path, long frames, long boidsPerFlock, unsigned long params, double *reference, long frameSize)
 {
-    double	t, result;
+    GoldenHeader header;
+    FILE *file = fopen(path, "rb");
+    if(!file){
+        return 0;
+    }
     
-    t = (double)(jit_rand() & 0x0000FFFF)/(double)(0x0000FFFF);
+    char loaded = fread(&header, sizeof(header), 1, file) == 1 &&
+                  header.magic == kGoldenMagic && header.version == kGoldenVersion && header.stride == kGoldenStride &&
+                  header.frames == frames && header.boidsPerFlock == boidsPerFlock && header.params == params &&
+                  fread(reference, sizeof(double)*frameSize, frames+1, file) == frames+1;
+    fclose(file);
+    return loaded;
+}
+
+
+/*!
+    @brief Stores a golden trajectory for later runs with the same seed
+ */
+void GoldenSave(const char *path, long frames, long boidsPerFlock, unsigned long params, double *reference, long frameSize)
+{
+    GoldenHeader header = {kGoldenMagic, kGoldenVersion, kGoldenStride, frames, boidsPerFlock, params};
+    FILE *file = fopen(path, "wb");
+    if(!file){
+        post("ERROR: golden: could not open %s", path);
+        return;
+    }
     
-    result = (t * (maxRange - minRange)) + minRange;
-    return(result);
+    if(fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(reference, sizeof(double)*frameSize, frames+1, file) == frames+1){
+        post("reference: recorded and stored in %s", path);
+    }else{
+        post("ERROR: golden: could not write %s", path);
+    }
+    fclose(file);
 }
 
 
 /*!
-    @brief Returns the squared distance between 2 points
+    @brief Returns a seeded pseudo-random number in [0, 1)
+    @discussion Independent of jit_rand() so that a scenario only depends on its own seed
  */
-double DistSqrToPt(double *firstPoint, double *secondPoint)
+double GoldenRandom(unsigned long *state)
 {
-    double	a, b,c;
-    a = firstPoint[x] - secondPoint[x];
-    b = firstPoint[y] - secondPoint[y];
-    c = firstPoint[z] - secondPoint[z];
-    return(a * a + b * b + c * c);
+    *state = (*state * 1103515245 + 12345) & 0x7FFFFFFF;
+    return (double)(*state >> 8)/(double)((0x7FFFFFFF >> 8) + 1);
 }
 
 
@@ -1565,6 +5866,8 @@ void InitFlock(t_jit_boids3d *flockPtr)
     //attractor initialization
     flockPtr->attractorLL = NULL;
     flockPtr->numAttractors = 0;
+    flockPtr->attractorsVersion++;
+    flockPtr->countsVersion++;
     
     //other initialization
     flockPtr->sizeOfNeighborhoodConnections = 0;
@@ -1576,6 +5879,39 @@ void InitFlock(t_jit_boids3d *flockPtr)
     flockPtr->birthLoc[y] = 0.0;
     flockPtr->birthLoc[z] = 0.0;
     
+    //flock colors and scales
+    memcpy(flockPtr->flockColor, kFlockColors, sizeof(flockPtr->flockColor));
+    for(int i=0; i<MAX_FLOCKS; i++){
+        flockPtr->flockScale[i] = 1.0;
+    }
+    
+    //flocks see each other as diffFlock says, with full weights
+    for(int i=0; i<MAX_FLOCKS; i++){
+        for(int j=0; j<MAX_FLOCKS; j++){
+            flockPtr->flockSees[i][j] = -1;
+            flockPtr->flockWeights[i][j][0] = 1.0;
+            flockPtr->flockWeights[i][j][1] = 1.0;
+            flockPtr->flockWeights[i][j][2] = 1.0;
+        }
+    }
+    
+    //the default camera of jit.gl.render, at (0, 0, 2) looking down -z
+    flockPtr->camera[0] = 0.0;
+    flockPtr->camera[1] = 0.0;
+    flockPtr->camera[2] = 2.0;
+    flockPtr->camera[3] = 0.0;
+    flockPtr->camera[4] = 0.0;
+    flockPtr->camera[5] = -1.0;
+    flockPtr->cameraCount = 6;
+    
+    //and its default lens, 45 degrees for a 4:3 window
+    flockPtr->frustum[0] = 45.0;
+    flockPtr->frustum[1] = 4.0/3.0;
+    flockPtr->frustum[2] = 0.1;
+    flockPtr->frustum[3] = 100.0;
+    flockPtr->frustumCount = 4;
+    flockPtr->lodCount = 0;
+    
     //Flock specific initialization
     for(int i=0; i<MAX_FLOCKS; i++){
         
@@ -1623,6 +5959,40 @@ int CalcNumBoids(t_jit_boids3d *flockPtr)
 }
 
 
+/*!
+    @brief Advances the fixed timestep clock to now
+    @param flockPtr A pointer to the flocks object
+    @return How many steps of 1/simRate the output has to take, 0 if it is still between the last two steps
+    @discussion Sets stepAlpha to the fraction of a step that is left over; the first output after fixedstep is turned on takes one step
+ */
+int FixedStepCount(t_jit_boids3d *flockPtr)
+{
+    double now = systimer_gettime();
+    double period = 1000.0/flockPtr->simRate;
+    int steps = 0;
+    
+    if(flockPtr->lastOutputTime > 0.0){
+        flockPtr->stepAccumulator += now - flockPtr->lastOutputTime;
+    }else{
+        flockPtr->stepAccumulator = period;
+    }
+    flockPtr->lastOutputTime = now;
+    
+    while(flockPtr->stepAccumulator >= period && steps < kMaxCatchUpSteps){
+        flockPtr->stepAccumulator -= period;
+        steps++;
+    }
+    
+    //too far behind (a stall or a very low output rate), drop what can't be caught up
+    if(flockPtr->stepAccumulator >= period){
+        flockPtr->stepAccumulator = fmod(flockPtr->stepAccumulator, period);
+    }
+    
+    flockPtr->stepAlpha = flockPtr->stepAccumulator/period;
+    return steps;
+}
+
+
 /*! 
     @brief Initializes a linked list of boids
     @param flockPtr a pointer to the flock object
@@ -1687,6 +6057,9 @@ NeighborLinePtr InitNeighborhoodLine(t_jit_boids3d *flockPtr, BoidPtr theBoid, B
     theLine->flockID[0] = theBoid->flockID;
     theLine->flockID[1] = theOtherBoid->flockID;
     
+    theLine->index[0] = -1; //found by LineIndexUpdate when the step is output
+    theLine->index[1] = -1;
+    
     return theLine;
 }
 
@@ -1744,6 +6117,12 @@ BoidPtr InitBoid(t_jit_boids3d *flockPtr)
     theBoid->newDir[y] = jit_math_cos(rndAngle);
     theBoid->newDir[z] = (jit_math_cos(rndAngle) + jit_math_sin(rndAngle)) * 0.5;
     theBoid->speed = (kMaxSpeed + kMinSpeed) * 0.5;
+    theBoid->neighborStep = -1;
+    theBoid->clusterSlot = -1;
+    theBoid->clusterID = -1;
+    theBoid->trailSlot = TrailClaim(flockPtr);
+    theBoid->packRow = -1;
+    theBoid->trailFilled = 0;
     
     for(int j=0; j<kMaxNeighbors;j++) {
         theBoid->neighbor[j] = 0;
@@ -1775,6 +6154,12 @@ AttractorPtr InitAttractor(t_jit_boids3d *flockPtr)
     theAttractor->onlyAttractedFlockID = -1;
     theAttractor->attractorRadius = 0.0;
     
+    AttractorStatsClear(&theAttractor->stepStats);
+    AttractorStatsClear(&theAttractor->stats);
+    for(int i=0; i<3; i++){
+        AttractorStatsClear(&theAttractor->frameStats[i]);
+    }
+    
     return theAttractor;
 }
 
@@ -1791,9 +6176,13 @@ t_jit_boids3d *jit_boids3d_new(void)
         flockPtr->flyRectCount		= 6;
         flockPtr->mode	 			= 0;
         flockPtr->allowNeighborsFromDiffFlock = 0;
+        flockPtr->simRate           = kDefaultSimRate;
+        flockPtr->stepAlpha         = 1.0;
+        systhread_mutex_new(&flockPtr->simLock, 0);
         
         //init boids params
         InitFlock(flockPtr);
+        OutputLayoutUpdate(flockPtr);
         
         flockPtr->d2r = 3.141592653589793238462643383279502884197169399375105820974944592307816406286208998628034825342117068/180.0;
         flockPtr->r2d = 180.0/3.141592653589793238462643383279502884197169399375105820974944592307816406286208998628034825342117068;
@@ -1809,6 +6198,13 @@ t_jit_boids3d *jit_boids3d_new(void)
  */
 void freeFlocks(t_jit_boids3d *flockPtr)
 {
+    //the simulation and warm-up threads must be gone before anything is freed
+    SimStop(flockPtr);
+    WarmupStop(flockPtr);
+    
+    //write out a trace that is still open
+    TraceStop(flockPtr);
+    
     for(int i=0; i<MAX_FLOCKS; i++){ //we're clearing each flock
         
         if(flockPtr->flockLL[i] == NULL){ //ensure that this flock is populated
@@ -1830,4 +6226,24 @@ void freeFlocks(t_jit_boids3d *flockPtr)
         flockPtr->flockLL[i] = NULL;
         
     }
+    
+    for(int i=0; i<3; i++){
+        if(flockPtr->simFrames[i]){
+            free(flockPtr->simFrames[i]->density);
+            free(flockPtr->simFrames[i]->trail);
+        }
+        free(flockPtr->simFrames[i]);
+        flockPtr->simFrames[i] = NULL;
+    }
+    
+    free(flockPtr->density);
+    free(flockPtr->densityPartials);
+    free(flockPtr->trails);
+    flockPtr->density = NULL;
+    flockPtr->densityPartials = NULL;
+    flockPtr->trails = NULL;
+    if(flockPtr->simLock){
+        systhread_mutex_free(flockPtr->simLock);
+        flockPtr->simLock = NULL;
+    }
 }